@@ -0,0 +1,751 @@
+//可替换的多路复用后端：select/poll/epoll LT/epoll ET/用户态eventpoll对比测试
+
+/*
+    network_io.c和epoll.c里的结论：
+        select/poll每次调用都要把全部fd交给内核、返回后再遍历全部fd，开销随fd总数线性增长；
+        epoll只在就绪时通过回调把epitem挂到rdlist，epoll_wait只拷贝就绪的那部分，开销只和就绪数有关；
+        所以连接多、活跃少（大量idle连接）时epoll优势明显，全部活跃时差别不大。
+    这里用同一个reactor循环跑不同的后端，在自己的机器上验证。
+
+    后端接口（struct demux_ops），除create外第一个参数都是create返回的实例，后端状态全在实例里：
+        create(maxfd)                   创建一个实例，fd编号不超过maxfd，失败返回NULL
+        add(self, fd, events)           关注fd，events是DEMUX_IN/DEMUX_OUT的组合
+        mod(self, fd, events)           修改关注的事件
+        del(self, fd)                   取消关注
+        wait(self, out, max, timeout)   等待最多timeout毫秒（-1一直等），就绪的fd和事件写到out，返回个数
+        notify(self, fd, revents)       fd当前的就绪状态变成了revents：只有用户态eventpoll需要，
+                                        使用者替它扮演协议栈（数据到达、读空、可写时调用），其他后端为NULL
+        destroy(self)
+    reactor循环只依赖这个接口，换后端不需要改循环本身，同一进程里也可以同时开多个实例。
+
+    五个后端：
+        select        每次调用前重建fd_set，返回后FD_ISSET遍历；fd编号必须小于FD_SETSIZE(1024)
+        poll          pollfd数组常驻，返回后遍历revents
+        epoll-lt      默认水平触发
+        epoll-et      边沿触发，读到EAGAIN为止（多一次read系统调用）
+        eventpoll     eventpoll.h里的用户态实现，写数据的一方调用ep_event_callback扮演协议栈，
+                      没有系统调用，作为“多路复用本身的数据结构开销”的下限参考
+
+    测试方法：
+        nfds个pipe，读端全部注册到后端；每一轮选出active个pipe各写1字节，
+        然后reactor循环wait + read，直到这一轮的所有字节都被读走。
+        active = nfds * 活跃比例，活跃的pipe每轮轮换。
+        输出：
+            wait(us)     每次wait调用的平均耗时（包含内核扫描和返回后用户态的遍历）
+            ns/event     wait总耗时 / 就绪事件数，即每个就绪事件分摊的多路复用开销
+            kevents/s    wait + read的整体吞吐（不含写端）
+
+    编译运行：
+        gcc -O2 -o demux_bench demux_bench.c -lpthread
+        ./demux_bench
+        ./demux_bench check     每个后端同时开两个实例，检查add/mod/del和可读可写事件是否互不干扰
+        需要2*nfds个fd，ulimit -n不够的nfds会跳过；select在fd编号超过FD_SETSIZE时输出n/a。
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "eventpoll.h"
+
+#define DEMUX_IN    0x1
+#define DEMUX_OUT   0x2
+
+struct demux_event {
+    int fd;
+    int events; //DEMUX_IN/DEMUX_OUT
+};
+
+//每个后端的状态都在create返回的self里，可以同时开多个实例
+struct demux_ops {
+    const char *name;
+    void *(*create)(int maxfd);
+    int (*add)(void *self, int fd, int events);
+    int (*mod)(void *self, int fd, int events);
+    int (*del)(void *self, int fd);
+    int (*wait)(void *self, struct demux_event *out, int max, int timeout);
+    void (*notify)(void *self, int fd, int revents);
+    void (*destroy)(void *self);
+    int edge; //边沿触发，读到EAGAIN为止
+};
+
+static uint32_t demux_to_epoll(int events) {
+    return ((events & DEMUX_IN) ? EPOLLIN : 0) | ((events & DEMUX_OUT) ? EPOLLOUT : 0);
+}
+
+static int demux_from_epoll(uint32_t events) {
+    //出错和挂断按可读可写报告，由读写调用拿到具体的错误
+    int ev = 0;
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) ev |= DEMUX_IN;
+    if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) ev |= DEMUX_OUT;
+    return ev;
+}
+
+/*-------------------------- select --------------------------*/
+
+struct select_demux {
+    fd_set rset;
+    fd_set wset;
+    int nwrite; //关注可写的fd数，为0时不传wset
+    int maxfd;  //select的nfds，只增不减，del之后偏大一点也不影响正确性
+    int cap;
+    int *fds;   //已注册的fd，del时用最后一个填空
+    int *pos;   //fd -> fds下标，-1表示未注册
+    int *events;
+    int nfds;
+};
+
+static void *select_create(int maxfd) {
+    if (maxfd >= FD_SETSIZE) {
+        return NULL;
+    }
+    struct select_demux *d = (struct select_demux*)calloc(1, sizeof(struct select_demux));
+    if (!d) {
+        return NULL;
+    }
+    FD_ZERO(&d->rset);
+    FD_ZERO(&d->wset);
+    d->maxfd = -1;
+    d->cap = maxfd + 1;
+    d->fds = (int*)malloc(sizeof(int) * d->cap);
+    d->pos = (int*)malloc(sizeof(int) * d->cap);
+    d->events = (int*)calloc(d->cap, sizeof(int));
+    if (!d->fds || !d->pos || !d->events) {
+        free(d->fds);
+        free(d->pos);
+        free(d->events);
+        free(d);
+        return NULL;
+    }
+    memset(d->pos, -1, sizeof(int) * d->cap);
+    return d;
+}
+
+static int select_mod(void *self, int fd, int events) {
+    struct select_demux *d = (struct select_demux*)self;
+    if (fd < 0 || fd >= d->cap || d->pos[fd] < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (events & DEMUX_IN) FD_SET(fd, &d->rset);
+    else FD_CLR(fd, &d->rset);
+    if ((events & DEMUX_OUT) && !(d->events[fd] & DEMUX_OUT)) {
+        FD_SET(fd, &d->wset);
+        d->nwrite++;
+    } else if (!(events & DEMUX_OUT) && (d->events[fd] & DEMUX_OUT)) {
+        FD_CLR(fd, &d->wset);
+        d->nwrite--;
+    }
+    d->events[fd] = events;
+    return 0;
+}
+
+static int select_add(void *self, int fd, int events) {
+    struct select_demux *d = (struct select_demux*)self;
+    if (fd < 0 || fd >= d->cap) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (d->pos[fd] >= 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    d->pos[fd] = d->nfds;
+    d->fds[d->nfds++] = fd;
+    d->events[fd] = 0;
+    if (fd > d->maxfd) d->maxfd = fd;
+    return select_mod(self, fd, events);
+}
+
+static int select_del(void *self, int fd) {
+    struct select_demux *d = (struct select_demux*)self;
+    if (select_mod(self, fd, 0) < 0) {
+        return -1;
+    }
+    int i = d->pos[fd];
+    int last = d->fds[--d->nfds];
+    d->fds[i] = last;
+    d->pos[last] = i;
+    d->pos[fd] = -1;
+    return 0;
+}
+
+static int select_wait(void *self, struct demux_event *out, int max, int timeout) {
+    struct select_demux *d = (struct select_demux*)self;
+    //select会改写传入的集合，每次调用都要重新拷贝一份
+    fd_set rset = d->rset;
+    fd_set wset;
+    if (d->nwrite) {
+        wset = d->wset;
+    }
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    int nready = select(d->maxfd + 1, &rset, d->nwrite ? &wset : NULL, NULL, timeout < 0 ? NULL : &tv);
+    if (nready <= 0) {
+        return nready;
+    }
+    //nready是两个集合里置位的总数，都找到了就不用再往后扫
+    int n = 0, i = 0, seen = 0;
+    for (i = 0; i < d->nfds && n < max && seen < nready; ++i) {
+        int fd = d->fds[i];
+        int r = FD_ISSET(fd, &rset) ? 1 : 0;
+        int w = d->nwrite && FD_ISSET(fd, &wset) ? 1 : 0;
+        if (r || w) {
+            out[n].fd = fd;
+            out[n].events = (r ? DEMUX_IN : 0) | (w ? DEMUX_OUT : 0);
+            n++;
+            seen += r + w;
+        }
+    }
+    return n;
+}
+
+static void select_destroy(void *self) {
+    struct select_demux *d = (struct select_demux*)self;
+    free(d->fds);
+    free(d->pos);
+    free(d->events);
+    free(d);
+}
+
+/*-------------------------- poll --------------------------*/
+
+struct poll_demux {
+    struct pollfd *fds; //del时用最后一个填空
+    int *pos;           //fd -> fds下标，-1表示未注册
+    int nfds;
+    int cap;
+};
+
+static void *poll_create(int maxfd) {
+    struct poll_demux *d = (struct poll_demux*)calloc(1, sizeof(struct poll_demux));
+    if (!d) {
+        return NULL;
+    }
+    d->cap = maxfd + 1;
+    d->fds = (struct pollfd*)malloc(sizeof(struct pollfd) * d->cap);
+    d->pos = (int*)malloc(sizeof(int) * d->cap);
+    if (!d->fds || !d->pos) {
+        free(d->fds);
+        free(d->pos);
+        free(d);
+        return NULL;
+    }
+    memset(d->pos, -1, sizeof(int) * d->cap);
+    return d;
+}
+
+static short poll_events(int events) {
+    return ((events & DEMUX_IN) ? POLLIN : 0) | ((events & DEMUX_OUT) ? POLLOUT : 0);
+}
+
+static int poll_add(void *self, int fd, int events) {
+    struct poll_demux *d = (struct poll_demux*)self;
+    if (fd < 0 || fd >= d->cap) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (d->pos[fd] >= 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    d->pos[fd] = d->nfds;
+    d->fds[d->nfds].fd = fd;
+    d->fds[d->nfds].events = poll_events(events);
+    d->fds[d->nfds].revents = 0;
+    d->nfds++;
+    return 0;
+}
+
+static int poll_mod(void *self, int fd, int events) {
+    struct poll_demux *d = (struct poll_demux*)self;
+    if (fd < 0 || fd >= d->cap || d->pos[fd] < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    d->fds[d->pos[fd]].events = poll_events(events);
+    return 0;
+}
+
+static int poll_del(void *self, int fd) {
+    struct poll_demux *d = (struct poll_demux*)self;
+    if (fd < 0 || fd >= d->cap || d->pos[fd] < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    int i = d->pos[fd];
+    d->fds[i] = d->fds[--d->nfds];
+    d->pos[d->fds[i].fd] = i;
+    d->pos[fd] = -1;
+    return 0;
+}
+
+static int poll_wait(void *self, struct demux_event *out, int max, int timeout) {
+    struct poll_demux *d = (struct poll_demux*)self;
+    int nready = poll(d->fds, d->nfds, timeout);
+    if (nready <= 0) {
+        return nready;
+    }
+    int n = 0, i = 0;
+    for (i = 0; i < d->nfds && n < max && n < nready; ++i) {
+        short re = d->fds[i].revents;
+        if (re) {
+            out[n].fd = d->fds[i].fd;
+            out[n].events = ((re & (POLLIN | POLLERR | POLLHUP)) ? DEMUX_IN : 0) |
+                            ((re & (POLLOUT | POLLERR | POLLHUP)) ? DEMUX_OUT : 0);
+            n++;
+        }
+    }
+    return n;
+}
+
+static void poll_destroy(void *self) {
+    struct poll_demux *d = (struct poll_demux*)self;
+    free(d->fds);
+    free(d->pos);
+    free(d);
+}
+
+/*-------------------------- epoll --------------------------*/
+
+struct epoll_demux {
+    int epfd;
+    int et;
+    struct epoll_event *events;
+    int max;
+};
+
+static void *epoll_create_common(int maxfd, int et) {
+    struct epoll_demux *d = (struct epoll_demux*)calloc(1, sizeof(struct epoll_demux));
+    if (!d) {
+        return NULL;
+    }
+    d->epfd = epoll_create1(EPOLL_CLOEXEC);
+    d->et = et;
+    d->max = maxfd + 1;
+    d->events = (struct epoll_event*)malloc(sizeof(struct epoll_event) * d->max);
+    if (d->epfd < 0 || !d->events) {
+        if (d->epfd >= 0) close(d->epfd);
+        free(d->events);
+        free(d);
+        return NULL;
+    }
+    return d;
+}
+
+static void *epoll_lt_create(int maxfd) {
+    return epoll_create_common(maxfd, 0);
+}
+
+static void *epoll_et_create(int maxfd) {
+    return epoll_create_common(maxfd, 1);
+}
+
+static int epoll_ctl_common(struct epoll_demux *d, int op, int fd, int events) {
+    struct epoll_event ev;
+    ev.events = demux_to_epoll(events) | (d->et ? EPOLLET : 0);
+    ev.data.fd = fd;
+    return epoll_ctl(d->epfd, op, fd, &ev);
+}
+
+static int epoll_add(void *self, int fd, int events) {
+    return epoll_ctl_common((struct epoll_demux*)self, EPOLL_CTL_ADD, fd, events);
+}
+
+static int epoll_mod(void *self, int fd, int events) {
+    return epoll_ctl_common((struct epoll_demux*)self, EPOLL_CTL_MOD, fd, events);
+}
+
+static int epoll_del(void *self, int fd) {
+    struct epoll_demux *d = (struct epoll_demux*)self;
+    return epoll_ctl(d->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int epoll_wait_fds(void *self, struct demux_event *out, int max, int timeout) {
+    struct epoll_demux *d = (struct epoll_demux*)self;
+    if (max > d->max) max = d->max;
+    int nready = epoll_wait(d->epfd, d->events, max, timeout);
+    int i = 0;
+    for (i = 0; i < nready; ++i) {
+        out[i].fd = d->events[i].data.fd;
+        out[i].events = demux_from_epoll(d->events[i].events);
+    }
+    return nready;
+}
+
+static void epoll_destroy(void *self) {
+    struct epoll_demux *d = (struct epoll_demux*)self;
+    close(d->epfd);
+    free(d->events);
+    free(d);
+}
+
+/*-------------------------- 用户态eventpoll --------------------------*/
+
+struct eventpoll_demux {
+    struct eventpoll *ep;
+    struct epoll_event *events;
+    int max;
+};
+
+static void *eventpoll_create(int maxfd) {
+    struct eventpoll_demux *d = (struct eventpoll_demux*)calloc(1, sizeof(struct eventpoll_demux));
+    if (!d) {
+        return NULL;
+    }
+    d->ep = ep_create();
+    d->max = maxfd + 1;
+    d->events = (struct epoll_event*)malloc(sizeof(struct epoll_event) * d->max);
+    if (!d->ep || !d->events) {
+        if (d->ep) ep_destroy(d->ep);
+        free(d->events);
+        free(d);
+        return NULL;
+    }
+    return d;
+}
+
+static int eventpoll_ctl(void *self, int op, int fd, int events) {
+    struct eventpoll_demux *d = (struct eventpoll_demux*)self;
+    struct epoll_event ev;
+    ev.events = demux_to_epoll(events);
+    ev.data.fd = fd;
+    return ep_ctl(d->ep, op, fd, &ev);
+}
+
+static int eventpoll_add(void *self, int fd, int events) {
+    return eventpoll_ctl(self, EPOLL_CTL_ADD, fd, events);
+}
+
+static int eventpoll_mod(void *self, int fd, int events) {
+    return eventpoll_ctl(self, EPOLL_CTL_MOD, fd, events);
+}
+
+static int eventpoll_del(void *self, int fd) {
+    return eventpoll_ctl(self, EPOLL_CTL_DEL, fd, 0);
+}
+
+static int eventpoll_wait(void *self, struct demux_event *out, int max, int timeout) {
+    struct eventpoll_demux *d = (struct eventpoll_demux*)self;
+    if (max > d->max) max = d->max;
+    int nready = ep_wait(d->ep, d->events, max, timeout);
+    int i = 0;
+    for (i = 0; i < nready; ++i) {
+        out[i].fd = d->events[i].data.fd;
+        out[i].events = demux_from_epoll(d->events[i].events);
+    }
+    return nready;
+}
+
+//协议栈：fd当前的就绪状态变成了revents（数据到达、读空、可写都走这里）
+static void eventpoll_notify(void *self, int fd, int revents) {
+    struct eventpoll_demux *d = (struct eventpoll_demux*)self;
+    ep_event_callback(d->ep, fd, demux_to_epoll(revents));
+}
+
+static void eventpoll_destroy(void *self) {
+    struct eventpoll_demux *d = (struct eventpoll_demux*)self;
+    ep_destroy(d->ep);
+    free(d->events);
+    free(d);
+}
+
+static const struct demux_ops g_backends[] = {
+    { "select",    select_create,    select_add,    select_mod,    select_del,
+        select_wait,    NULL,             select_destroy,    0 },
+    { "poll",      poll_create,      poll_add,      poll_mod,      poll_del,
+        poll_wait,      NULL,             poll_destroy,      0 },
+    { "epoll-lt",  epoll_lt_create,  epoll_add,     epoll_mod,     epoll_del,
+        epoll_wait_fds, NULL,             epoll_destroy,     0 },
+    { "epoll-et",  epoll_et_create,  epoll_add,     epoll_mod,     epoll_del,
+        epoll_wait_fds, NULL,             epoll_destroy,     1 },
+    { "eventpoll", eventpoll_create, eventpoll_add, eventpoll_mod, eventpoll_del,
+        eventpoll_wait, eventpoll_notify, eventpoll_destroy, 0 },
+};
+
+/*-------------------------- reactor + 测试 --------------------------*/
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct result {
+    double wait_us;
+    double ns_per_event;
+    double kevents;
+};
+
+static int run(const struct demux_ops *ops, int nfds, int active, int rounds, struct result *res) {
+    int *rfd = (int*)malloc(sizeof(int) * nfds);
+    int *wfd = (int*)malloc(sizeof(int) * nfds);
+    int maxfd = 0, i = 0;
+
+    for (i = 0; i < nfds; ++i) {
+        int p[2];
+        if (pipe2(p, O_NONBLOCK) < 0) {
+            while (--i >= 0) {
+                close(rfd[i]);
+                close(wfd[i]);
+            }
+            free(rfd);
+            free(wfd);
+            return -1;
+        }
+        rfd[i] = p[0];
+        wfd[i] = p[1];
+        if (p[0] > maxfd) maxfd = p[0];
+        if (p[1] > maxfd) maxfd = p[1];
+    }
+
+    void *self = ops->create(maxfd);
+    int ret = self ? 0 : -1;
+    for (i = 0; i < nfds && ret == 0; ++i) {
+        ret = ops->add(self, rfd[i], DEMUX_IN);
+    }
+
+    struct demux_event *ready = (struct demux_event*)malloc(sizeof(struct demux_event) * (maxfd + 1));
+    if (!ready) {
+        ret = -1;
+    }
+    uint64_t wait_ns = 0, total_ns = 0;
+    unsigned long waits = 0, events = 0;
+    int r = 0;
+
+    for (r = 0; r < rounds && ret == 0; ++r) {
+        int first = (int)(((uint64_t)r * active) % nfds);
+        for (i = 0; i < active; ++i) {
+            int k = (first + i) % nfds;
+            if (write(wfd[k], "x", 1) != 1) {
+                ret = -1;
+                break;
+            }
+            if (ops->notify) {
+                ops->notify(self, rfd[k], DEMUX_IN);
+            }
+        }
+
+        int left = active;
+        uint64_t t0 = now_ns();
+        while (left > 0) {
+            uint64_t w0 = now_ns();
+            int n = ops->wait(self, ready, maxfd + 1, -1);
+            wait_ns += now_ns() - w0;
+            waits++;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                ret = -1;
+                break;
+            }
+
+            int j = 0;
+            for (j = 0; j < n; ++j) {
+                char buf[64];
+                int fd = ready[j].fd;
+                int got = read(fd, buf, sizeof(buf));
+                if (got > 0) {
+                    left -= got;
+                    events++;
+                }
+                if (ops->edge) {
+                    //ET必须读到EAGAIN，否则下次不会再通知
+                    while (read(fd, buf, sizeof(buf)) > 0) {}
+                }
+                if (ops->notify) {
+                    //读空了，不再可读
+                    ops->notify(self, fd, 0);
+                }
+            }
+        }
+        total_ns += now_ns() - t0;
+    }
+
+    if (ret == 0 && waits) {
+        res->wait_us = wait_ns / 1000.0 / waits;
+        res->ns_per_event = events ? (double)wait_ns / events : 0;
+        res->kevents = total_ns ? events * 1e6 / total_ns : 0;
+    }
+
+    if (self) {
+        ops->destroy(self);
+    }
+    for (i = 0; i < nfds; ++i) {
+        close(rfd[i]);
+        close(wfd[i]);
+    }
+    free(ready);
+    free(rfd);
+    free(wfd);
+    return ret;
+}
+
+/*-------------------------- check：两个实例 + add/mod/del --------------------------*/
+
+//不阻塞地wait一次，返回fd在结果里的事件，不在结果里返回0
+static int check_wait(const struct demux_ops *ops, void *self, int fd, int *n) {
+    struct demux_event out[16];
+    int ev = 0, i = 0;
+    *n = ops->wait(self, out, 16, 0);
+    for (i = 0; i < *n; ++i) {
+        if (out[i].fd == fd) ev |= out[i].events;
+    }
+    return ev;
+}
+
+static int check_arrive(const struct demux_ops *ops, void *self, int wfd, int rfd) {
+    if (write(wfd, "x", 1) != 1) {
+        return -1;
+    }
+    if (ops->notify) {
+        ops->notify(self, rfd, DEMUX_IN);
+    }
+    return 0;
+}
+
+//返回0表示通过，否则返回出错的步骤
+static int check_backend(const struct demux_ops *ops) {
+    int p0[2], p1[2];
+    if (pipe2(p0, O_NONBLOCK) < 0) {
+        return 1;
+    }
+    if (pipe2(p1, O_NONBLOCK) < 0) {
+        close(p0[0]);
+        close(p0[1]);
+        return 1;
+    }
+    int maxfd = p0[0], i = 0;
+    for (i = 0; i < 2; ++i) {
+        if (p0[i] > maxfd) maxfd = p0[i];
+        if (p1[i] > maxfd) maxfd = p1[i];
+    }
+
+    void *a = ops->create(maxfd);
+    void *b = ops->create(maxfd);
+    int step = 0, n = 0;
+    if (!a || !b) {
+        step = 1;
+    }
+
+    //1.两个实例各自只看到自己注册的fd
+    if (!step && (ops->add(a, p0[0], DEMUX_IN) < 0 || ops->add(b, p1[0], DEMUX_IN) < 0 ||
+                  check_arrive(ops, a, p0[1], p0[0]) < 0 || check_arrive(ops, b, p1[1], p1[0]) < 0)) {
+        step = 1;
+    }
+    if (!step && (check_wait(ops, a, p0[0], &n) != DEMUX_IN || check_wait(ops, a, p1[0], &n) != 0)) {
+        step = 1;
+    }
+    if (!step && check_wait(ops, b, p1[0], &n) != DEMUX_IN) {
+        step = 1;
+    }
+
+    //2.关注写端可写
+    if (!step) {
+        if (ops->add(a, p0[1], DEMUX_OUT) < 0) {
+            step = 2;
+        } else if (ops->notify) {
+            ops->notify(a, p0[1], DEMUX_OUT);
+        }
+    }
+    if (!step && check_wait(ops, a, p0[1], &n) != DEMUX_OUT) {
+        step = 2;
+    }
+
+    //3.mod成只关注可读（管道写端永远不可读）就不再报告，改回来又报告
+    if (!step && (ops->mod(a, p0[1], DEMUX_IN) < 0 || check_wait(ops, a, p0[1], &n) != 0)) {
+        step = 3;
+    }
+    if (!step && (ops->mod(a, p0[1], DEMUX_OUT) < 0 || check_wait(ops, a, p0[1], &n) != DEMUX_OUT)) {
+        step = 3;
+    }
+
+    //4.del之后再来数据也不报告，另一个实例不受影响
+    if (!step && (ops->del(a, p0[0]) < 0 || ops->del(a, p0[1]) < 0 ||
+                  check_arrive(ops, a, p0[1], p0[0]) < 0 || check_arrive(ops, b, p1[1], p1[0]) < 0)) {
+        step = 4;
+    }
+    if (!step && (check_wait(ops, a, p0[0], &n) != 0 || n != 0 || check_wait(ops, b, p1[0], &n) != DEMUX_IN)) {
+        step = 4;
+    }
+
+    if (a) ops->destroy(a);
+    if (b) ops->destroy(b);
+    for (i = 0; i < 2; ++i) {
+        close(p0[i]);
+        close(p1[i]);
+    }
+    return step;
+}
+
+static int check_all(void) {
+    int failed = 0, b = 0;
+    for (b = 0; b < (int)(sizeof(g_backends) / sizeof(g_backends[0])); ++b) {
+        int step = check_backend(&g_backends[b]);
+        if (step) {
+            printf("%-10s FAIL at step %d\n", g_backends[b].name, step);
+            failed = 1;
+        } else {
+            printf("%-10s ok\n", g_backends[b].name);
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "check") == 0) {
+        return check_all() < 0 ? 1 : 0;
+    }
+
+    static const int sizes[] = { 64, 256, 480, 1024, 4096, 8192, 16384 };
+    static const double fractions[] = { 0.01, 0.1, 1.0 };
+
+    //尽量调高fd上限
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+
+    printf("%6s %7s %-10s %10s %10s %10s\n", "nfds", "active", "backend", "wait(us)", "ns/event", "kevents/s");
+
+    int s = 0, f = 0, b = 0;
+    for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); ++s) {
+        int nfds = sizes[s];
+        if ((rlim_t)nfds * 2 + 16 > rl.rlim_cur) {
+            printf("skip nfds %d: RLIMIT_NOFILE %lu\n", nfds, (unsigned long)rl.rlim_cur);
+            continue;
+        }
+
+        for (f = 0; f < 3; ++f) {
+            int active = (int)(nfds * fractions[f]);
+            if (active < 1) active = 1;
+            //每个配置的总工作量大致相同
+            int rounds = 200000 / (nfds + active);
+            if (rounds < 20) rounds = 20;
+
+            for (b = 0; b < (int)(sizeof(g_backends) / sizeof(g_backends[0])); ++b) {
+                struct result res;
+                memset(&res, 0, sizeof(res));
+                if (run(&g_backends[b], nfds, active, rounds, &res) < 0) {
+                    printf("%6d %7d %-10s %10s\n", nfds, active, g_backends[b].name, "n/a");
+                    continue;
+                }
+                printf("%6d %7d %-10s %10.2f %10.1f %10.0f\n",
+                    nfds, active, g_backends[b].name, res.wait_us, res.ns_per_event, res.kevents);
+            }
+        }
+    }
+    return 0;
+}
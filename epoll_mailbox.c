@@ -0,0 +1,226 @@
+//跨线程向reactor投递任务：eventfd + MPSC mailbox及ping测试
+
+/*
+    实现见mailbox.h，这里是把mailbox挂到epoll循环上的方式，以及一个跨线程ping的基准测试。
+
+    reactor循环：
+        eventfd和监听socket、客户端socket一样注册在同一个epfd上，
+        epoll_wait返回eventfd可读，说明有其他线程投递了任务，在reactor线程里把队列取空执行。
+        任务在reactor线程里执行，所以可以直接操作连接的fd和输出缓冲，不需要加锁。
+
+    ping测试：
+        N个投递线程，每个线程循环投递ping任务，ping里带着投递时刻的时间戳，
+        reactor执行ping时用当前时间减去时间戳，就是post->execute的延迟。
+        每个线程一次投递BATCH个ping，等它们全部执行完再投递下一批（限制在途数量，避免测成队列堆积）。
+        输出：吞吐(ping/s)，延迟p50/p99/max，以及每次eventfd唤醒平均执行了多少任务（合并效果）。
+
+    编译运行：
+        gcc -O2 -o epoll_mailbox epoll_mailbox.c -lpthread
+        ./epoll_mailbox [每个线程的ping数]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include "mailbox.h"
+
+#define BATCH       32
+#define MAX_THREADS 16
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct reactor {
+    int epfd;
+    struct mailbox mb;
+    volatile int stop;
+
+    //只在reactor线程写
+    uint64_t *lat;
+    unsigned long nlat;
+};
+
+struct poster;
+
+struct ping {
+    struct mb_task node; //必须是第一个成员，fn里直接强转
+    uint64_t ts;
+    struct poster *owner;
+    struct reactor *r;
+};
+
+struct poster {
+    pthread_t tid;
+    struct reactor *r;
+    int count;
+    atomic_int done;
+    struct ping pings[BATCH];
+};
+
+static void ping_exec(struct mb_task *task) {
+    struct ping *p = (struct ping*)task;
+    struct reactor *r = p->r;
+
+    r->lat[r->nlat++] = now_ns() - p->ts;
+    atomic_fetch_add_explicit(&p->owner->done, 1, memory_order_release);
+}
+
+static void stop_exec(struct mb_task *task) {
+    struct ping *p = (struct ping*)task;
+    p->r->stop = 1;
+}
+
+static void *reactor_loop(void *arg) {
+    struct reactor *r = (struct reactor*)arg;
+    struct epoll_event events[64];
+
+    while (!r->stop) {
+        int nready = epoll_wait(r->epfd, events, 64, -1);
+        if (nready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        int i = 0;
+        for (i = 0; i < nready; ++i) {
+            if (events[i].data.fd == r->mb.efd) {
+                mailbox_drain(&r->mb, 1024);
+            } else {
+                //socket的accept/recv/send，同epoll.c
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *poster_loop(void *arg) {
+    struct poster *ps = (struct poster*)arg;
+    struct mb_task *tasks[BATCH];
+    int posted = 0;
+
+    while (posted < ps->count) {
+        int n = ps->count - posted;
+        if (n > BATCH) n = BATCH;
+
+        atomic_store_explicit(&ps->done, 0, memory_order_relaxed);
+
+        int i = 0;
+        uint64_t ts = now_ns();
+        for (i = 0; i < n; ++i) {
+            ps->pings[i].ts = ts;
+            tasks[i] = &ps->pings[i].node;
+        }
+        mailbox_post_batch(&ps->r->mb, tasks, n);
+
+        //等这一批执行完再复用ping对象
+        while (atomic_load_explicit(&ps->done, memory_order_acquire) < n) {
+            sched_yield();
+        }
+        posted += n;
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int run(int nthreads, int count) {
+    struct reactor r;
+    memset(&r, 0, sizeof(r));
+
+    if (mailbox_init(&r.mb) < 0) {
+        return -1;
+    }
+    r.epfd = epoll_create(1);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = r.mb.efd;
+    epoll_ctl(r.epfd, EPOLL_CTL_ADD, r.mb.efd, &ev);
+
+    r.lat = (uint64_t*)malloc(sizeof(uint64_t) * (size_t)nthreads * count);
+    if (!r.lat) {
+        return -2;
+    }
+
+    struct poster *ps = (struct poster*)calloc(nthreads, sizeof(struct poster));
+    int i = 0, j = 0;
+    for (i = 0; i < nthreads; ++i) {
+        ps[i].r = &r;
+        ps[i].count = count;
+        for (j = 0; j < BATCH; ++j) {
+            ps[i].pings[j].node.fn = ping_exec;
+            ps[i].pings[j].owner = &ps[i];
+            ps[i].pings[j].r = &r;
+        }
+    }
+
+    pthread_t rtid;
+    pthread_create(&rtid, NULL, reactor_loop, &r);
+
+    uint64_t start = now_ns();
+    for (i = 0; i < nthreads; ++i) {
+        pthread_create(&ps[i].tid, NULL, poster_loop, &ps[i]);
+    }
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(ps[i].tid, NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    struct ping stop;
+    stop.node.fn = stop_exec;
+    stop.r = &r;
+    mailbox_post(&r.mb, &stop.node);
+    pthread_join(rtid, NULL);
+
+    unsigned long total = r.nlat;
+    unsigned long wakeups = atomic_load(&r.mb.wakeups);
+    qsort(r.lat, total, sizeof(uint64_t), cmp_u64);
+
+    printf("%7d %12.0f %10.1f %10.1f %10.1f %12.1f\n",
+        nthreads,
+        total * 1e9 / elapsed,
+        r.lat[total / 2] / 1000.0,
+        r.lat[total * 99 / 100] / 1000.0,
+        r.lat[total - 1] / 1000.0,
+        wakeups ? (double)total / wakeups : 0.0);
+
+    free(ps);
+    free(r.lat);
+    close(r.epfd);
+    mailbox_destroy(&r.mb);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int count = 100000;
+    if (argc >= 2) {
+        count = atoi(argv[1]);
+    }
+    if (count <= 0) {
+        return -1;
+    }
+
+    printf("%7s %12s %10s %10s %10s %12s\n",
+        "threads", "ping/s", "p50(us)", "p99(us)", "max(us)", "task/wakeup");
+
+    int nthreads = 0;
+    for (nthreads = 1; nthreads <= MAX_THREADS; nthreads *= 2) {
+        if (run(nthreads, count) < 0) {
+            return -2;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,895 @@
+//reactor中的信号处理：signalfd + 优雅退出(drain) + 通过Unix socket传递监听fd的无缝重启
+
+/*
+    network_io.c里说服务器要处理三类事件：I/O事件、定时器事件和信号，epoll.c只处理了I/O。
+    收到SIGTERM时进程直接被杀，可能正写到一半；也没有办法重新加载或者平滑下线。
+
+    1.signalfd
+        传统的信号处理函数在任意时刻打断主循环，里面只能调用异步信号安全的函数，
+        通常的做法是在handler里写一个pipe再回到主循环处理（self-pipe trick）。
+        signalfd把这件事做成了fd：
+            sigprocmask(SIG_BLOCK)阻塞这些信号，不再走默认处理/handler；
+            signalfd(-1, &mask, ...)得到一个fd，信号到达时fd可读，read出struct signalfd_siginfo；
+            把它注册到epoll，信号就和socket事件一样在主循环里被顺序处理，不存在重入问题。
+        注意信号掩码会被fork/exec继承，exec新进程前要恢复。
+
+    2.优雅退出（SIGTERM/SIGINT）
+        a.停止accept：监听fd从epoll删除并close（如果已经交给新进程，内核里的监听socket不会被关闭）；
+        b.给每个连接发GOAWAY帧，客户端收到后不再发新请求，等手上的响应回来就自己断开重连；
+        c.继续读写，把输出队列flush完；
+        d.GOAWAY之后空闲超过DRAIN_IDLE_MS的连接直接关闭；
+        e.到了DRAIN_DEADLINE_MS不管还有没有数据都关闭，进程退出。
+        只有服务端先关闭一个客户端正在发请求的连接才会出错，GOAWAY把“谁来关”交给了客户端。
+
+    3.无缝重启（SIGHUP）
+        目标是部署时不丢accept队列里的连接，也不拒绝新连接。
+        监听socket（以及它的accept队列）是内核对象，只要还有一个进程持有它的fd就不会关闭，
+        所以把fd交给新进程，新旧进程在交接期间共用同一个监听socket：
+            a.旧进程监听一个控制Unix socket（CTRL_PATH）；
+            b.SIGHUP时旧进程fork + exec自己（部署时也可以由外部直接启动新版本）；
+            c.新进程启动时先connect控制socket，连上了说明是接管：
+              旧进程用sendmsg + SCM_RIGHTS把监听fd发过来；
+            d.新进程把fd注册到自己的epoll，开始accept，然后回一个字节'R'；
+            e.旧进程收到'R'后进入上面的优雅退出流程。
+        从c到e之间两个进程都可能accept到连接，都能正常服务；accept队列里的连接始终有人取。
+        新进程接管后重新bind控制socket和写pid文件，可以继续下一次重启。
+
+    4.压测
+        ./epoll_signal restart-bench 8888
+        启动服务器，开64个连接做ping-pong（每个连接200个请求后断开重连，让accept也在压力里），
+        第2秒给服务器发SIGHUP，按100ms窗口输出请求数、最大延迟和错误数。
+
+    编译运行：
+        gcc -O2 -o epoll_signal epoll_signal.c
+        ./epoll_signal 8888                  服务器
+        kill -HUP `cat /tmp/epoll_signal.8888.pid`   无缝重启
+        kill -TERM `cat /tmp/epoll_signal.8888.pid`  优雅退出
+        ./epoll_signal restart-bench 8888    重启压测
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define MAX_CONN            65536
+#define RBUF_SIZE           (65535 + 2)
+#define MSG_ECHO            1
+#define MSG_GOAWAY          0xFFFD
+
+#define DRAIN_IDLE_MS       1000
+#define DRAIN_DEADLINE_MS   10000
+
+#define CTRL_PATH_FMT       "/tmp/epoll_signal.%d.sock"
+#define PID_PATH_FMT        "/tmp/epoll_signal.%d.pid"
+
+static inline uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void set_nonblock(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/*-------------------------- fd传递 --------------------------*/
+
+static int send_fd(int sock, int fd) {
+    char byte = 'L';
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } u;
+    memset(&u, 0, sizeof(u));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+static int recv_fd(int sock) {
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } u;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/*-------------------------- 服务器 --------------------------*/
+
+enum {
+    CONN_CLIENT,
+    CONN_CTRL,  //新进程连过来的控制连接
+};
+
+struct conn {
+    int fd;
+    int type;
+    int goaway;
+    int want_out; //当前是否注册了EPOLLOUT
+    uint64_t last_active;
+    struct conn *prev, *next; //客户端连接链表，drain时只遍历活着的连接
+
+    int rlen;
+    unsigned char *rbuf;
+
+    unsigned char *wbuf;
+    int woff, wlen, wcap;
+};
+
+struct server {
+    int port;
+    char **argv;
+
+    int epfd;
+    int sigfd;
+    int listenfd;
+    int ctrlfd;
+    int nconn;
+    struct conn *conns[MAX_CONN];
+    struct conn *clients; //所有CONN_CLIENT连接
+
+    int draining;
+    uint64_t drain_start;
+    pid_t upgrading; //已经fork出的新进程，等它回'R'
+    int handed_over; //新进程已经接管，控制socket路径和pid文件归它所有
+};
+
+static void conn_close(struct server *s, struct conn *c) {
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    s->conns[c->fd] = NULL;
+    if (c->type == CONN_CLIENT) {
+        if (c->prev) c->prev->next = c->next;
+        else s->clients = c->next;
+        if (c->next) c->next->prev = c->prev;
+        s->nconn--;
+    }
+    free(c->rbuf);
+    free(c->wbuf);
+    free(c);
+}
+
+static struct conn *conn_add(struct server *s, int fd, int type) {
+    if (fd >= MAX_CONN) {
+        close(fd);
+        return NULL;
+    }
+    struct conn *c = (struct conn*)calloc(1, sizeof(struct conn));
+    if (c) {
+        c->rbuf = (unsigned char*)malloc(RBUF_SIZE);
+    }
+    if (!c || !c->rbuf) {
+        free(c);
+        close(fd);
+        return NULL;
+    }
+    c->fd = fd;
+    c->type = type;
+    c->last_active = now_ms();
+    set_nonblock(fd);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev);
+
+    s->conns[fd] = c;
+    if (type == CONN_CLIENT) {
+        c->next = s->clients;
+        if (s->clients) s->clients->prev = c;
+        s->clients = c;
+        s->nconn++;
+    }
+    return c;
+}
+
+//只在输出队列空/非空切换时改epoll兴趣，避免每帧一次epoll_ctl
+static void conn_update_events(struct server *s, struct conn *c) {
+    int want = c->wlen > c->woff;
+    if (want == c->want_out) {
+        return;
+    }
+    c->want_out = want;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+    ev.data.fd = c->fd;
+    epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+//把输出队列尽量写出去，返回-1表示连接出错已关闭
+static int conn_flush(struct server *s, struct conn *c) {
+    while (c->wlen > c->woff) {
+        int ret = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            conn_close(s, c);
+            return -1;
+        }
+        c->woff += ret;
+    }
+    if (c->woff == c->wlen) {
+        c->woff = c->wlen = 0;
+    }
+    conn_update_events(s, c);
+    return 0;
+}
+
+static int conn_send_frame(struct server *s, struct conn *c, uint16_t msgid, const unsigned char *data, uint16_t len) {
+    int need = 6 + len;
+    if (c->wlen + need > c->wcap && c->woff > 0) {
+        //先把已发送的部分挪走
+        memmove(c->wbuf, c->wbuf + c->woff, c->wlen - c->woff);
+        c->wlen -= c->woff;
+        c->woff = 0;
+    }
+    if (c->wlen + need > c->wcap) {
+        int cap = c->wcap ? c->wcap : 4096;
+        while (cap < c->wlen + need) cap *= 2;
+        unsigned char *p = (unsigned char*)realloc(c->wbuf, cap);
+        if (!p) {
+            conn_close(s, c);
+            return -1;
+        }
+        c->wbuf = p;
+        c->wcap = cap;
+    }
+
+    unsigned char *p = c->wbuf + c->wlen;
+    p[0] = (len + 4) >> 8;
+    p[1] = (len + 4) & 0xff;
+    p[2] = msgid >> 8;
+    p[3] = msgid & 0xff;
+    p[4] = len >> 8;
+    p[5] = len & 0xff;
+    memcpy(p + 6, data, len);
+    c->wlen += need;
+
+    return conn_flush(s, c);
+}
+
+static void client_read(struct server *s, struct conn *c) {
+    int ret = recv(c->fd, c->rbuf + c->rlen, RBUF_SIZE - c->rlen, 0);
+    if (ret <= 0) {
+        if (ret < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        conn_close(s, c);
+        return;
+    }
+    c->rlen += ret;
+    c->last_active = now_ms();
+
+    int off = 0;
+    while (c->rlen - off >= 2) {
+        int bodysize = (c->rbuf[off] << 8) | c->rbuf[off + 1];
+        if (c->rlen - off < 2 + bodysize) break;
+
+        const unsigned char *body = c->rbuf + off + 2;
+        if (bodysize >= 4) {
+            uint16_t msgid = (body[0] << 8) | body[1];
+            uint16_t datasize = (body[2] << 8) | body[3];
+            if (msgid == MSG_ECHO && datasize <= bodysize - 4) {
+                if (conn_send_frame(s, c, MSG_ECHO, body + 4, datasize) < 0) {
+                    return;
+                }
+            }
+        }
+        off += 2 + bodysize;
+    }
+    if (off > 0) {
+        memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+        c->rlen -= off;
+    }
+}
+
+static void start_drain(struct server *s) {
+    if (s->draining) {
+        return;
+    }
+    s->draining = 1;
+    s->drain_start = now_ms();
+    fprintf(stderr, "[%d] draining %d connections\n", getpid(), s->nconn);
+
+    //a.停止accept
+    if (s->listenfd >= 0) {
+        epoll_ctl(s->epfd, EPOLL_CTL_DEL, s->listenfd, NULL);
+        close(s->listenfd);
+        s->listenfd = -1;
+    }
+    if (s->ctrlfd >= 0) {
+        epoll_ctl(s->epfd, EPOLL_CTL_DEL, s->ctrlfd, NULL);
+        close(s->ctrlfd);
+        s->ctrlfd = -1;
+    }
+
+    //b.通知客户端，发送失败时c会被关闭并摘链，所以先取next
+    struct conn *c = s->clients;
+    while (c) {
+        struct conn *next = c->next;
+        c->goaway = 1;
+        c->last_active = s->drain_start;
+        conn_send_frame(s, c, MSG_GOAWAY, NULL, 0);
+        c = next;
+    }
+}
+
+//drain期间每轮循环检查一次，返回1表示可以退出
+static int drain_tick(struct server *s) {
+    uint64_t now = now_ms();
+    int deadline = now - s->drain_start >= DRAIN_DEADLINE_MS;
+
+    struct conn *c = s->clients;
+    while (c) {
+        struct conn *next = c->next;
+        int idle = c->wlen == c->woff && now - c->last_active >= DRAIN_IDLE_MS;
+        if (deadline || idle) {
+            conn_close(s, c);
+        }
+        c = next;
+    }
+    return s->nconn == 0;
+}
+
+static void write_pidfile(int port) {
+    char path[64];
+    snprintf(path, sizeof(path), PID_PATH_FMT, port);
+    FILE *fp = fopen(path, "w");
+    if (fp) {
+        fprintf(fp, "%d\n", getpid());
+        fclose(fp);
+    }
+}
+
+static int ctrl_listen(int port) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), CTRL_PATH_FMT, port);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+    尝试从正在运行的旧进程接管监听fd，成功返回监听fd，*ctrl返回和旧进程的连接（接管完成后回'R'）。
+    没有旧进程返回-1。
+*/
+static int ctrl_takeover(int port, int *ctrl) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), CTRL_PATH_FMT, port);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int lfd = recv_fd(fd);
+    if (lfd < 0) {
+        close(fd);
+        return -1;
+    }
+    *ctrl = fd;
+    return lfd;
+}
+
+static int tcp_listen(int port) {
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(sockfd, (struct sockaddr*)&addr, sizeof(struct sockaddr_in)) || listen(sockfd, 1024) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+//fork + exec自己，新进程会通过控制socket接管
+static pid_t spawn_upgrade(struct server *s) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        //恢复信号掩码，否则新进程继承了阻塞的信号
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        execv("/proc/self/exe", s->argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void on_signal(struct server *s) {
+    struct signalfd_siginfo si;
+    while (read(s->sigfd, &si, sizeof(si)) == sizeof(si)) {
+        switch (si.ssi_signo) {
+        case SIGTERM:
+        case SIGINT:
+            start_drain(s);
+            break;
+        case SIGHUP:
+            if (!s->draining && !s->upgrading) {
+                s->upgrading = spawn_upgrade(s);
+                fprintf(stderr, "[%d] upgrade: spawned %d\n", getpid(), s->upgrading);
+                if (s->upgrading < 0) s->upgrading = 0;
+            }
+            break;
+        case SIGCHLD: {
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                if (pid == s->upgrading) {
+                    //新进程没有接管就退出了，继续服务
+                    fprintf(stderr, "[%d] upgrade failed, child %d exited\n", getpid(), pid);
+                    s->upgrading = 0;
+                }
+            }
+            break;
+        }
+        }
+    }
+}
+
+static void on_ctrl_accept(struct server *s) {
+    int fd = accept4(s->ctrlfd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    if (s->draining || send_fd(fd, s->listenfd) < 0) {
+        close(fd);
+        return;
+    }
+    conn_add(s, fd, CONN_CTRL);
+}
+
+static void on_ctrl_read(struct server *s, struct conn *c) {
+    char byte;
+    int ret = recv(c->fd, &byte, 1, 0);
+    if (ret < 0 && errno == EAGAIN) {
+        return;
+    }
+    conn_close(s, c);
+    if (ret == 1 && byte == 'R') {
+        //新进程已经在accept了
+        s->upgrading = 0;
+        s->handed_over = 1;
+        start_drain(s);
+    }
+}
+
+static void on_accept(struct server *s) {
+    while (1) {
+        int clientfd = accept4(s->listenfd, NULL, NULL, SOCK_CLOEXEC);
+        if (clientfd < 0) {
+            return;
+        }
+        int on = 1;
+        setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        conn_add(s, clientfd, CONN_CLIENT);
+    }
+}
+
+static int serve(int port, char **argv) {
+    static struct server s;
+    s.port = port;
+    s.argv = argv;
+    s.ctrlfd = -1;
+
+    //阻塞信号，交给signalfd
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        return -1;
+    }
+    s.sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (s.sigfd < 0) {
+        return -1;
+    }
+
+    //先尝试接管，没有旧进程再自己bind
+    int oldctrl = -1;
+    s.listenfd = ctrl_takeover(port, &oldctrl);
+    if (s.listenfd < 0) {
+        s.listenfd = tcp_listen(port);
+    }
+    if (s.listenfd < 0) {
+        return -2;
+    }
+    set_nonblock(s.listenfd);
+
+    //CLOEXEC：SIGHUP时exec的新进程不应该继承旧进程的epoll
+    s.epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev, events[1024];
+
+    ev.events = EPOLLIN;
+    ev.data.fd = s.sigfd;
+    epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.sigfd, &ev);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = s.listenfd;
+    epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.listenfd, &ev);
+
+    if (oldctrl >= 0) {
+        //已经在epoll里了，通知旧进程可以下线
+        char byte = 'R';
+        if (write(oldctrl, &byte, 1) != 1) {
+            fprintf(stderr, "[%d] notify old process failed\n", getpid());
+        }
+        close(oldctrl);
+        fprintf(stderr, "[%d] took over listen fd\n", getpid());
+    }
+
+    s.ctrlfd = ctrl_listen(port);
+    if (s.ctrlfd >= 0) {
+        ev.events = EPOLLIN;
+        ev.data.fd = s.ctrlfd;
+        epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.ctrlfd, &ev);
+    }
+    write_pidfile(port);
+
+    while (1) {
+        int nready = epoll_wait(s.epfd, events, 1024, s.draining ? 100 : -1);
+        if (nready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        int i = 0;
+        for (i = 0; i < nready; ++i) {
+            int fd = events[i].data.fd;
+
+            if (fd == s.sigfd) {
+                on_signal(&s);
+            } else if (fd == s.listenfd) {
+                on_accept(&s);
+            } else if (fd == s.ctrlfd) {
+                on_ctrl_accept(&s);
+            } else {
+                struct conn *c = s.conns[fd];
+                if (!c) continue;
+
+                if (c->type == CONN_CTRL) {
+                    on_ctrl_read(&s, c);
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT) {
+                    if (conn_flush(&s, c) < 0) continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                    client_read(&s, c);
+                }
+            }
+        }
+
+        if (s.draining && drain_tick(&s)) {
+            break;
+        }
+    }
+
+    //最后一代进程退出时清理控制socket和pid文件，交接过的旧进程不能删新进程的
+    if (!s.handed_over) {
+        char path[64];
+        snprintf(path, sizeof(path), CTRL_PATH_FMT, port);
+        unlink(path);
+        snprintf(path, sizeof(path), PID_PATH_FMT, port);
+        unlink(path);
+    }
+
+    fprintf(stderr, "[%d] exit\n", getpid());
+    return 0;
+}
+
+/*-------------------------- 重启压测 --------------------------*/
+
+#define LOAD_CONNS      64
+#define LOAD_REQS       200    //每个连接的请求数，之后断开重连
+#define LOAD_SECONDS    6
+#define RESTART_AT_MS   2000
+#define WINDOW_MS       100
+
+struct lconn {
+    int fd;
+    int connecting;
+    int outstanding; //已发出还没收到响应的请求
+    int goaway;
+    int reqs;
+    uint64_t sent_at;
+    int rlen;
+    unsigned char rbuf[256];
+};
+
+struct lstats {
+    unsigned long reqs;
+    unsigned long errors;
+    uint64_t max_us;
+};
+
+static void lconn_open(int epfd, struct lconn *lc, int port, struct lstats *w) {
+    memset(lc, 0, sizeof(*lc));
+    lc->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int on = 1;
+    setsockopt(lc->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(lc->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        w->errors++;
+        close(lc->fd);
+        lc->fd = -1;
+        return;
+    }
+    lc->connecting = 1;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = lc;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, lc->fd, &ev);
+}
+
+static void lconn_close(int epfd, struct lconn *lc) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, lc->fd, NULL);
+    close(lc->fd);
+    lc->fd = -1;
+}
+
+static int lconn_ping(struct lconn *lc) {
+    unsigned char buf[6 + 8];
+    uint64_t ts = now_us();
+    buf[0] = 0;
+    buf[1] = 12;
+    buf[2] = 0;
+    buf[3] = MSG_ECHO;
+    buf[4] = 0;
+    buf[5] = 8;
+    memcpy(buf + 6, &ts, 8);
+    if (send(lc->fd, buf, sizeof(buf), MSG_NOSIGNAL) != (ssize_t)sizeof(buf)) {
+        return -1;
+    }
+    lc->sent_at = ts;
+    lc->outstanding = 1;
+    lc->reqs++;
+    return 0;
+}
+
+static void lconn_event(int epfd, struct lconn *lc, uint32_t events, struct lstats *w, uint64_t *lat, unsigned long *nlat) {
+    if (lc->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(lc->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err || (events & (EPOLLERR | EPOLLHUP))) {
+            w->errors++;
+            lconn_close(epfd, lc);
+            return;
+        }
+        lc->connecting = 0;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = lc;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, lc->fd, &ev);
+        if (lconn_ping(lc) < 0) {
+            w->errors++;
+            lconn_close(epfd, lc);
+        }
+        return;
+    }
+
+    int ret = recv(lc->fd, lc->rbuf + lc->rlen, sizeof(lc->rbuf) - lc->rlen, 0);
+    if (ret <= 0) {
+        if (ret < 0 && errno == EAGAIN) return;
+        //有请求在途时被断开才算错误
+        if (lc->outstanding) w->errors++;
+        lconn_close(epfd, lc);
+        return;
+    }
+    lc->rlen += ret;
+
+    int off = 0;
+    while (lc->rlen - off >= 6) {
+        int bodysize = (lc->rbuf[off] << 8) | lc->rbuf[off + 1];
+        if (lc->rlen - off < 2 + bodysize) break;
+        uint16_t msgid = (lc->rbuf[off + 2] << 8) | lc->rbuf[off + 3];
+
+        if (msgid == MSG_GOAWAY) {
+            lc->goaway = 1;
+        } else if (msgid == MSG_ECHO && lc->outstanding) {
+            uint64_t us = now_us() - lc->sent_at;
+            lc->outstanding = 0;
+            w->reqs++;
+            if (us > w->max_us) w->max_us = us;
+            lat[(*nlat)++ % (1 << 22)] = us;
+        }
+        off += 2 + bodysize;
+    }
+    memmove(lc->rbuf, lc->rbuf + off, lc->rlen - off);
+    lc->rlen -= off;
+
+    if (!lc->outstanding) {
+        if (lc->goaway || lc->reqs >= LOAD_REQS) {
+            lconn_close(epfd, lc);
+        } else if (lconn_ping(lc) < 0) {
+            w->errors++;
+            lconn_close(epfd, lc);
+        }
+    }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int restart_bench(int port, char *self) {
+    pid_t server = fork();
+    if (server == 0) {
+        char portstr[16];
+        snprintf(portstr, sizeof(portstr), "%d", port);
+        char *args[] = { self, portstr, NULL };
+        execv("/proc/self/exe", args);
+        _exit(127);
+    }
+    usleep(300 * 1000);
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    static struct lconn lconns[LOAD_CONNS];
+    static uint64_t lat[1 << 22];
+    unsigned long nlat = 0;
+    struct lstats total = { 0, 0, 0 }, w = { 0, 0, 0 };
+    int i = 0;
+
+    for (i = 0; i < LOAD_CONNS; ++i) {
+        lconn_open(epfd, &lconns[i], port, &w);
+    }
+
+    uint64_t start = now_ms(), wstart = start;
+    int restarted = 0;
+    struct epoll_event events[LOAD_CONNS];
+
+    printf("%8s %8s %10s %8s\n", "t(ms)", "reqs", "max(us)", "errors");
+    while (now_ms() - start < LOAD_SECONDS * 1000) {
+        int nready = epoll_wait(epfd, events, LOAD_CONNS, 10);
+        for (i = 0; i < nready; ++i) {
+            lconn_event(epfd, (struct lconn*)events[i].data.ptr, events[i].events, &w, lat, &nlat);
+        }
+        //断开的连接立即重连
+        for (i = 0; i < LOAD_CONNS; ++i) {
+            if (lconns[i].fd < 0) {
+                lconn_open(epfd, &lconns[i], port, &w);
+            }
+        }
+
+        uint64_t now = now_ms();
+        if (!restarted && now - start >= RESTART_AT_MS) {
+            kill(server, SIGHUP);
+            restarted = 1;
+            printf("-------- SIGHUP --------\n");
+        }
+        if (now - wstart >= WINDOW_MS) {
+            printf("%8lu %8lu %10lu %8lu\n", (unsigned long)(now - start), w.reqs, (unsigned long)w.max_us, w.errors);
+            total.reqs += w.reqs;
+            total.errors += w.errors;
+            if (w.max_us > total.max_us) total.max_us = w.max_us;
+            memset(&w, 0, sizeof(w));
+            wstart = now;
+        }
+    }
+
+    unsigned long n = nlat < (1 << 22) ? nlat : (1 << 22);
+    qsort(lat, n, sizeof(uint64_t), cmp_u64);
+    printf("total reqs %lu, errors %lu, p50 %luus, p99 %luus, max %luus\n",
+        total.reqs, total.errors,
+        n ? (unsigned long)lat[n / 2] : 0, n ? (unsigned long)lat[n * 99 / 100] : 0,
+        (unsigned long)total.max_us);
+
+    //停掉接管后的新进程
+    char path[64];
+    snprintf(path, sizeof(path), PID_PATH_FMT, port);
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        int pid = 0;
+        if (fscanf(fp, "%d", &pid) == 1 && pid > 0) {
+            kill(pid, SIGTERM);
+        }
+        fclose(fp);
+    }
+    waitpid(server, NULL, 0);
+    for (i = 0; i < LOAD_CONNS; ++i) {
+        if (lconns[i].fd >= 0) close(lconns[i].fd);
+    }
+    close(epfd);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        return -1;
+    }
+    if (strcmp(argv[1], "restart-bench") == 0) {
+        if (argc < 3) {
+            return -1;
+        }
+        return restart_bench(atoi(argv[2]), argv[0]);
+    }
+    return serve(atoi(argv[1]), argv);
+}
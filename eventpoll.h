@@ -0,0 +1,302 @@
+//用户态eventpoll：按epoll_principle.c的结构实现的epoll
+
+/*
+    epoll_principle.c讲了内核epoll的两个结构：
+        eventpoll：每个epoll实例一个，rbtree保存所有监听的IO，rdlist保存就绪的IO；
+        epitem：每个被监听的IO一个，挂在rbtree上，就绪时挂到rdlist上。
+    以及三个锁：mtx保护rbtree，spinlock保护rdlist，cond + cdmtx用于epoll_wait的阻塞等待。
+
+    这里把它搬到用户态，接口与epoll一一对应：
+        ep_create()         -> epoll_create
+        ep_ctl()            -> epoll_ctl
+        ep_wait()           -> epoll_wait
+        ep_event_callback() -> 协议栈在4个时机（见epoll_principle.c 三、epoll回调）调用的回调
+    没有内核协议栈替我们调用回调，所以“协议栈”由使用者扮演：
+    数据到达、对端关闭、可写时调用ep_event_callback(ep, fd, 当前就绪状态)，
+    读空了（不再可读）时用新的就绪状态再调一次，LT模式靠它知道什么时候不再就绪。
+
+    和内核实现的差别：
+        1.rbtree换成了按fd下标的数组。这里的fd都是小整数，直接下标就是O(1)查找，
+          原理一样：O(1)/O(logn)的查找，而不是select/poll那样每次遍历全部fd。
+        2.rdlist是手写的侵入式双向链表（glibc没有sys/queue.h）。
+        3.LT：内核在epoll_wait返回LT的epitem后会把它放回rdlist，下次再poll一次设备确认是否仍就绪；
+          这里用epitem->revents记录协议栈最近一次报告的就绪状态，copy出去之后仍然就绪就挂回rdlist尾部。
+        4.ET：只在回调（即状态变化）时挂入rdlist，copy出去后就摘掉。
+
+    线程安全：回调通常来自别的线程（loopback.c里是对端线程）。
+        回调在mtx下查items，ep_ctl的ADD（可能realloc items）和DEL（free epitem）也在mtx下，
+        所以回调不会碰到已经释放的内存；rdlist和revents仍然由spinlock保护。
+        rdnum在spinlock下修改，ep_wait在等待时不拿spinlock读它，所以是原子变量。
+*/
+
+#ifndef EVENTPOLL_H
+#define EVENTPOLL_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+
+struct epitem {
+    struct epitem *rdnext;
+    struct epitem *rdprev;
+    int rdy;     //是否在rdlist中
+
+    int sockfd;
+    uint32_t revents; //协议栈报告的当前就绪状态
+    struct epoll_event event;
+};
+
+struct eventpoll {
+    struct epitem **items; //代替rbtree，按fd下标
+    int nitems;
+
+    struct epitem rdlist;  //哨兵
+    atomic_int rdnum;
+
+    int waiting;
+
+    pthread_mutex_t mtx;       //items update
+    pthread_spinlock_t lock;   //rdlist update
+
+    pthread_cond_t cond;       //block for event
+    pthread_mutex_t cdmtx;     //mutex for cond
+};
+
+static inline void ep_rdlist_insert(struct eventpoll *ep, struct epitem *epi) {
+    epi->rdprev = ep->rdlist.rdprev;
+    epi->rdnext = &ep->rdlist;
+    ep->rdlist.rdprev->rdnext = epi;
+    ep->rdlist.rdprev = epi;
+    epi->rdy = 1;
+    atomic_fetch_add_explicit(&ep->rdnum, 1, memory_order_relaxed);
+}
+
+static inline void ep_rdlist_remove(struct eventpoll *ep, struct epitem *epi) {
+    epi->rdprev->rdnext = epi->rdnext;
+    epi->rdnext->rdprev = epi->rdprev;
+    epi->rdnext = epi->rdprev = NULL;
+    epi->rdy = 0;
+    atomic_fetch_sub_explicit(&ep->rdnum, 1, memory_order_relaxed);
+}
+
+static inline struct eventpoll *ep_create(void) {
+    struct eventpoll *ep = (struct eventpoll*)calloc(1, sizeof(struct eventpoll));
+    if (!ep) {
+        return NULL;
+    }
+    ep->rdlist.rdnext = ep->rdlist.rdprev = &ep->rdlist;
+    pthread_mutex_init(&ep->mtx, NULL);
+    pthread_spin_init(&ep->lock, PTHREAD_PROCESS_PRIVATE);
+    pthread_cond_init(&ep->cond, NULL);
+    pthread_mutex_init(&ep->cdmtx, NULL);
+    return ep;
+}
+
+static inline void ep_destroy(struct eventpoll *ep) {
+    int i = 0;
+    for (i = 0; i < ep->nitems; ++i) {
+        free(ep->items[i]);
+    }
+    free(ep->items);
+    pthread_mutex_destroy(&ep->mtx);
+    pthread_spin_destroy(&ep->lock);
+    pthread_cond_destroy(&ep->cond);
+    pthread_mutex_destroy(&ep->cdmtx);
+    free(ep);
+}
+
+static inline int ep_ctl(struct eventpoll *ep, int op, int sockid, struct epoll_event *event) {
+    if (sockid < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&ep->mtx);
+
+    if (sockid >= ep->nitems) {
+        if (op != EPOLL_CTL_ADD) {
+            pthread_mutex_unlock(&ep->mtx);
+            errno = ENOENT;
+            return -1;
+        }
+        int n = ep->nitems ? ep->nitems : 64;
+        while (n <= sockid) n *= 2;
+        struct epitem **items = (struct epitem**)realloc(ep->items, n * sizeof(struct epitem*));
+        if (!items) {
+            pthread_mutex_unlock(&ep->mtx);
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(items + ep->nitems, 0, (n - ep->nitems) * sizeof(struct epitem*));
+        ep->items = items;
+        ep->nitems = n;
+    }
+
+    struct epitem *epi = ep->items[sockid];
+
+    if (op == EPOLL_CTL_ADD) {
+        if (epi) {
+            pthread_mutex_unlock(&ep->mtx);
+            errno = EEXIST;
+            return -1;
+        }
+        epi = (struct epitem*)calloc(1, sizeof(struct epitem));
+        if (!epi) {
+            pthread_mutex_unlock(&ep->mtx);
+            errno = ENOMEM;
+            return -1;
+        }
+        epi->sockfd = sockid;
+        memcpy(&epi->event, event, sizeof(struct epoll_event));
+        ep->items[sockid] = epi;
+    } else if (op == EPOLL_CTL_MOD) {
+        if (!epi) {
+            pthread_mutex_unlock(&ep->mtx);
+            errno = ENOENT;
+            return -1;
+        }
+        pthread_spin_lock(&ep->lock);
+        epi->event = *event;
+        //和内核一样，MOD时如果已经就绪就重新报告；不再关心当前的就绪状态就从rdlist摘掉
+        uint32_t hit = epi->revents & (event->events | EPOLLERR | EPOLLHUP);
+        if (hit && !epi->rdy) {
+            ep_rdlist_insert(ep, epi);
+        } else if (!hit && epi->rdy) {
+            ep_rdlist_remove(ep, epi);
+        }
+        pthread_spin_unlock(&ep->lock);
+    } else if (op == EPOLL_CTL_DEL) {
+        if (!epi) {
+            pthread_mutex_unlock(&ep->mtx);
+            errno = ENOENT;
+            return -1;
+        }
+        pthread_spin_lock(&ep->lock);
+        if (epi->rdy) {
+            ep_rdlist_remove(ep, epi);
+        }
+        pthread_spin_unlock(&ep->lock);
+        ep->items[sockid] = NULL;
+        free(epi);
+    }
+
+    pthread_mutex_unlock(&ep->mtx);
+    return 0;
+}
+
+/*
+    协议栈回调：sockid当前的就绪状态变成了revents（EPOLLIN/EPOLLOUT/EPOLLERR/EPOLLHUP的组合）。
+    就绪且关心这个事件、又不在rdlist中时挂入rdlist，并唤醒ep_wait；
+    不再就绪时从rdlist摘掉，免得ep_wait被一个已经过期的epitem唤醒。
+*/
+static inline int ep_event_callback(struct eventpoll *ep, int sockid, uint32_t revents) {
+    //和ep_ctl互斥：查找期间items不会被realloc，epitem也不会被DEL释放
+    pthread_mutex_lock(&ep->mtx);
+    if (sockid < 0 || sockid >= ep->nitems || !ep->items[sockid]) {
+        pthread_mutex_unlock(&ep->mtx);
+        return -1;
+    }
+    struct epitem *epi = ep->items[sockid];
+
+    pthread_spin_lock(&ep->lock);
+    epi->revents = revents;
+    uint32_t hit = revents & (epi->event.events | EPOLLERR | EPOLLHUP);
+    int wake = 0;
+    if (hit && !epi->rdy) {
+        ep_rdlist_insert(ep, epi);
+        wake = 1;
+    } else if (!hit && epi->rdy) {
+        ep_rdlist_remove(ep, epi);
+    }
+    pthread_spin_unlock(&ep->lock);
+    pthread_mutex_unlock(&ep->mtx);
+
+    if (wake) {
+        pthread_mutex_lock(&ep->cdmtx);
+        if (ep->waiting) {
+            pthread_cond_signal(&ep->cond);
+        }
+        pthread_mutex_unlock(&ep->cdmtx);
+    }
+    return 0;
+}
+
+static inline int ep_wait(struct eventpoll *ep, struct epoll_event *events, int maxevents, int timeout) {
+    if (maxevents <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct timespec deadline;
+    if (timeout > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    int cnt = 0;
+    int expired = 0;
+    while (1) {
+        if (atomic_load(&ep->rdnum) == 0 && timeout != 0) {
+            pthread_mutex_lock(&ep->cdmtx);
+            ep->waiting = 1;
+
+            if (timeout > 0) {
+                while (atomic_load(&ep->rdnum) == 0) {
+                    if (pthread_cond_timedwait(&ep->cond, &ep->cdmtx, &deadline) == ETIMEDOUT) {
+                        expired = 1;
+                        break;
+                    }
+                }
+            } else {
+                while (atomic_load(&ep->rdnum) == 0) {
+                    pthread_cond_wait(&ep->cond, &ep->cdmtx);
+                }
+            }
+
+            ep->waiting = 0;
+            pthread_mutex_unlock(&ep->cdmtx);
+        }
+
+        pthread_spin_lock(&ep->lock);
+
+        int rdnum = atomic_load_explicit(&ep->rdnum, memory_order_relaxed);
+        int num = rdnum > maxevents ? maxevents : rdnum;
+
+        while (num != 0 && ep->rdlist.rdnext != &ep->rdlist) {
+            struct epitem *epi = ep->rdlist.rdnext;
+            ep_rdlist_remove(ep, epi);
+
+            uint32_t hit = epi->revents & (epi->event.events | EPOLLERR | EPOLLHUP);
+            if (hit) {
+                events[cnt].events = hit;
+                events[cnt].data = epi->event.data;
+                cnt++;
+
+                //LT：仍然就绪就挂回队尾，下次epoll_wait再报告
+                if (!(epi->event.events & EPOLLET)) {
+                    ep_rdlist_insert(ep, epi);
+                }
+            }
+            num--;
+        }
+
+        pthread_spin_unlock(&ep->lock);
+
+        //被唤醒但取到的都是已经不就绪的epitem时，和epoll_wait一样继续等到超时，不返回0
+        if (cnt > 0 || timeout == 0 || expired) {
+            return cnt;
+        }
+    }
+}
+
+#endif
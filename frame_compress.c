@@ -0,0 +1,524 @@
+//帧层压缩：msgid标志位 + 大小阈值 + 预训练字典 + 每个reactor线程的压缩上下文池
+
+/*
+    游戏里大量流量是重复的protobuf状态（Msgtest这种：名字、邮箱这些字符串反复出现）。
+    在帧层做可选压缩，业务层无感知。
+
+    1.标志位
+        帧格式同protobuf.c：2 byte bodysize + body(2 byte msgid + 2 byte datasize + data)。
+        msgid的最高位作为压缩标志（业务msgid不会用到0x8000以上）：
+            msgid & 0x8000 == 0：data是原始数据，同原来一样
+            msgid & 0x8000 != 0：data是压缩数据，长度为bodysize - 4；datasize记录的是解压后的长度
+        接收方按datasize一次性分配（或者复用）解压缓冲区，不需要猜长度。
+
+    2.阈值
+        小于COMPRESS_MIN的消息不压缩；压缩后没有变小的也按原始数据发，接收方只看标志位。
+
+    3.预训练字典
+        deflate的滑动窗口从空开始，一条200字节的消息内部几乎没有重复，单独压缩基本压不动。
+        预设字典就是“在压缩这条消息之前，假装已经压缩过这段字典”，
+        消息里出现的字段tag、常见名字、邮箱后缀都能直接引用字典里的内容，小消息也能压缩。
+        字典在启动时从文件加载（服务器和客户端使用同一份），没有文件时用样本消息拼一个。
+        deflate会优先匹配距离近的内容（距离越近编码越短），所以最常见的片段放在字典末尾。
+        字典id用adler32。
+
+    4.按连接协商
+        压缩是每个连接自己的状态（struct zconn），不是全局开关：
+            连接建立时双方各发一个MSG_ZHELLO（data是4字节字典id，没有字典时为0）；
+            收到对端的ZHELLO之前，本端只发原始帧；
+            收到后才开启压缩，字典id一致且不为0才使用字典，否则只做无字典的deflate；
+            本端没有发过ZHELLO却收到了压缩帧，说明对端不守协议，按格式错误处理。
+        双方都按“两个id是否相同”判断，所以发送方用没用字典，接收方不需要额外的标志位就知道。
+        不认识ZHELLO的旧对端不会回ZHELLO，这个连接就一直不压缩。
+
+    5.上下文池
+        deflateInit要分配约256KB的状态，不能每条消息都init/end。
+        每个reactor线程持有一对z_stream（deflate/inflate），每条消息只做Reset + SetDictionary。
+        reactor是单线程的，这对上下文不需要加锁；用__thread保存，多reactor时各自一份。
+
+    这里使用zlib的raw deflate（windowBits = -15）：没有zlib头和adler32尾，每条消息省6字节，
+    字典id的校验放到连接建立时。环境里没有zstd，zstd的字典模式原理相同，压缩率和速度更好。
+
+    编译运行：
+        gcc -O2 -o frame_compress frame_compress.c -lz
+        ./frame_compress [字典文件]
+        在不同消息大小下对比：不压缩、无字典压缩、字典压缩的线上字节数、每条消息CPU时间和延迟。
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+#define MSGID_COMPRESSED  0x8000
+#define COMPRESS_MIN      128
+#define DICT_MAX          (32 * 1024)
+#define FRAME_MAX         (65535 + 2)
+#define MSG_ZHELLO        0x7FFE  //压缩协商
+
+/*-------------------------- 字典 --------------------------*/
+
+struct zdict {
+    unsigned char data[DICT_MAX];
+    unsigned int len;
+    uLong id; //adler32
+};
+
+static struct zdict g_dict;
+
+static int dict_load(struct zdict *d, const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return -1;
+    }
+    d->len = (unsigned int)fread(d->data, 1, DICT_MAX, fp);
+    fclose(fp);
+    d->id = adler32(adler32(0, Z_NULL, 0), d->data, d->len);
+    return d->len ? 0 : -1;
+}
+
+static unsigned char *put_varint(unsigned char *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+static unsigned char *put_string(unsigned char *p, int field, const char *s) {
+    size_t len = strlen(s);
+    p = put_varint(p, (field << 3) | 2);
+    p = put_varint(p, len);
+    memcpy(p, s, len);
+    return p + len;
+}
+
+static const char *g_names[] = {
+    "xiaoming", "xiaohong", "zhangsan", "lisi", "wangwu", "zhaoliu", "sunqi", "zhouba",
+};
+
+static const char *g_domains[] = {
+    "@163.com", "@qq.com", "@126.com", "@gmail.com",
+};
+
+//编码一条Msgtest（字段定义见protobuf_arena.c），返回长度
+static int encode_msgtest(unsigned char *buf, uint32_t i) {
+    char name[32], email[48];
+    const char *n = g_names[(i * 7) % 8];
+    snprintf(name, sizeof(name), "%s%u", n, i % 100);
+    snprintf(email, sizeof(email), "%s%u%s", n, i % 100, g_domains[(i * 3) % 4]);
+
+    unsigned char *p = buf;
+    p = put_string(p, 1, name);
+    p = put_varint(p, (2 << 3) | 0);
+    p = put_varint(p, 18 + i % 40);
+    p = put_string(p, 3, email);
+    p = put_varint(p, (4 << 3) | 0);
+    p = put_varint(p, i & 1);
+
+    double account = 888.88 + (i % 1000) * 0.5;
+    uint64_t bits;
+    memcpy(&bits, &account, sizeof(bits));
+    p = put_varint(p, (5 << 3) | 1);
+    int k = 0;
+    for (k = 0; k < 8; ++k) {
+        *p++ = (unsigned char)(bits >> (8 * k));
+    }
+    return (int)(p - buf);
+}
+
+/*
+    没有字典文件时用样本消息拼一个，和离线训练的思路一样：把最常见的内容放进去，高频的放后面。
+    统计所有样本里4字节片段的出现次数，每条样本的得分是它包含的片段次数之和，
+    取得分最高的几条放进字典，按得分从低到高排列，最高的在字典末尾，离要压缩的消息最近。
+*/
+#define DICT_SAMPLES    512
+#define DICT_TARGET     4096
+#define GRAM_BUCKETS    65536
+
+struct dict_sample {
+    unsigned char rec[128];
+    int len;
+    uint64_t score;
+};
+
+static inline uint32_t gram_hash(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> 16;
+}
+
+static int cmp_score_desc(const void *a, const void *b) {
+    const struct dict_sample *x = (const struct dict_sample*)a;
+    const struct dict_sample *y = (const struct dict_sample*)b;
+    return x->score < y->score ? 1 : (x->score > y->score ? -1 : 0);
+}
+
+static void dict_build_from_samples(struct zdict *d) {
+    static struct dict_sample samples[DICT_SAMPLES];
+    static uint32_t grams[GRAM_BUCKETS];
+    int i = 0, k = 0;
+
+    memset(grams, 0, sizeof(grams));
+    for (i = 0; i < DICT_SAMPLES; ++i) {
+        samples[i].len = encode_msgtest(samples[i].rec, 997 * i + 13);
+        for (k = 0; k + 4 <= samples[i].len; ++k) {
+            grams[gram_hash(samples[i].rec + k)]++;
+        }
+    }
+    for (i = 0; i < DICT_SAMPLES; ++i) {
+        samples[i].score = 0;
+        for (k = 0; k + 4 <= samples[i].len; ++k) {
+            samples[i].score += grams[gram_hash(samples[i].rec + k)];
+        }
+    }
+    qsort(samples, DICT_SAMPLES, sizeof(struct dict_sample), cmp_score_desc);
+
+    //得分最高的n条能放下，倒着写进字典：得分最低的在前，最高的在末尾
+    int n = 0, total = 0;
+    while (n < DICT_SAMPLES && total + samples[n].len <= DICT_TARGET) {
+        total += samples[n++].len;
+    }
+    d->len = 0;
+    for (i = n - 1; i >= 0; --i) {
+        memcpy(d->data + d->len, samples[i].rec, samples[i].len);
+        d->len += samples[i].len;
+    }
+    d->id = adler32(adler32(0, Z_NULL, 0), d->data, d->len);
+}
+
+/*-------------------------- 上下文池 --------------------------*/
+
+struct zctx {
+    int inited;
+    z_stream def;
+    z_stream inf;
+};
+
+static __thread struct zctx t_zctx;
+
+static struct zctx *zctx_get(void) {
+    struct zctx *z = &t_zctx;
+    if (!z->inited) {
+        memset(z, 0, sizeof(*z));
+        //level 1：游戏服务器更在意CPU，压缩级别高了对小消息收益很小
+        //memLevel 4：哈希表只有默认的1/16，每条消息deflateReset清零的开销也小
+        if (deflateInit2(&z->def, 1, Z_DEFLATED, -15, 4, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return NULL;
+        }
+        if (inflateInit2(&z->inf, -15) != Z_OK) {
+            deflateEnd(&z->def);
+            return NULL;
+        }
+        z->inited = 1;
+    }
+    return z;
+}
+
+static void zctx_release(void) {
+    struct zctx *z = &t_zctx;
+    if (z->inited) {
+        deflateEnd(&z->def);
+        inflateEnd(&z->inf);
+        z->inited = 0;
+    }
+}
+
+/*-------------------------- 按连接协商 --------------------------*/
+
+static inline void put_be16(unsigned char *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static inline uint16_t get_be16(const unsigned char *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+struct zconn {
+    uint32_t dict_id;   //本端声明的字典id，0表示不用字典
+    int hello_sent;
+    int enabled;        //收到对端ZHELLO后才能发压缩帧
+    int use_dict;       //双方字典id一致
+};
+
+static void zconn_init(struct zconn *zc, int with_dict) {
+    memset(zc, 0, sizeof(*zc));
+    zc->dict_id = with_dict && g_dict.len ? (uint32_t)g_dict.id : 0;
+}
+
+//封一个ZHELLO帧到out，返回帧长
+static int zconn_hello(struct zconn *zc, unsigned char *out) {
+    put_be16(out, 4 + 4);
+    put_be16(out + 2, MSG_ZHELLO);
+    put_be16(out + 4, 4);
+    out[6] = zc->dict_id >> 24;
+    out[7] = (zc->dict_id >> 16) & 0xff;
+    out[8] = (zc->dict_id >> 8) & 0xff;
+    out[9] = zc->dict_id & 0xff;
+    zc->hello_sent = 1;
+    return 10;
+}
+
+static int zconn_on_hello(struct zconn *zc, const unsigned char *data, uint16_t len) {
+    if (len < 4) {
+        return -1;
+    }
+    uint32_t peer = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+    zc->enabled = 1;
+    zc->use_dict = zc->dict_id != 0 && peer == zc->dict_id;
+    return 0;
+}
+
+/*-------------------------- 封包/解包 --------------------------*/
+
+/*
+    封一帧到out（至少FRAME_MAX字节），连接已经协商了压缩、超过阈值且压缩有收益时压缩。返回帧长，-1失败。
+*/
+static int frame_encode(struct zconn *zc, unsigned char *out, uint16_t msgid, const unsigned char *data, uint16_t len) {
+    if (len > FRAME_MAX - 6 || (msgid & MSGID_COMPRESSED)) {
+        return -1;
+    }
+
+    if (zc->enabled && len >= COMPRESS_MIN) {
+        struct zctx *z = zctx_get();
+        if (z) {
+            deflateReset(&z->def);
+            if (zc->use_dict) {
+                deflateSetDictionary(&z->def, g_dict.data, g_dict.len);
+            }
+            z->def.next_in = (Bytef*)data;
+            z->def.avail_in = len;
+            z->def.next_out = out + 6;
+            //压缩后不小于原始数据就没有意义，输出空间给到len - 1，放不下就放弃
+            z->def.avail_out = len - 1;
+
+            if (deflate(&z->def, Z_FINISH) == Z_STREAM_END) {
+                uint16_t clen = (uint16_t)z->def.total_out;
+                put_be16(out, clen + 4);
+                put_be16(out + 2, msgid | MSGID_COMPRESSED);
+                put_be16(out + 4, len);
+                return 6 + clen;
+            }
+        }
+    }
+
+    put_be16(out, len + 4);
+    put_be16(out + 2, msgid);
+    put_be16(out + 4, len);
+    memcpy(out + 6, data, len);
+    return 6 + len;
+}
+
+/*
+    解一帧的body，压缩的数据解到buf（至少65535字节）里。
+    data、len返回原始数据，返回msgid，-1失败。
+    ZHELLO由这里处理掉，返回MSG_ZHELLO，调用方跳过即可。
+*/
+static int frame_decode_body(struct zconn *zc, const unsigned char *body, int bodysize, unsigned char *buf,
+    const unsigned char **data, uint16_t *len) {
+
+    if (bodysize < 4) {
+        return -1;
+    }
+    uint16_t msgid = get_be16(body);
+    uint16_t datasize = get_be16(body + 2);
+
+    if (!(msgid & MSGID_COMPRESSED)) {
+        if (datasize > bodysize - 4) {
+            return -1;
+        }
+        *data = body + 4;
+        *len = datasize;
+        if (msgid == MSG_ZHELLO && zconn_on_hello(zc, *data, *len) < 0) {
+            return -1;
+        }
+        return msgid;
+    }
+
+    //没声明过支持压缩，对端不应该发压缩帧
+    if (!zc->hello_sent) {
+        return -1;
+    }
+    struct zctx *z = zctx_get();
+    if (!z) {
+        return -1;
+    }
+    inflateReset(&z->inf);
+    if (zc->use_dict) {
+        //raw inflate可以在开始前直接设置字典
+        inflateSetDictionary(&z->inf, g_dict.data, g_dict.len);
+    }
+    z->inf.next_in = (Bytef*)(body + 4);
+    z->inf.avail_in = bodysize - 4;
+    z->inf.next_out = buf;
+    z->inf.avail_out = datasize;
+
+    if (inflate(&z->inf, Z_FINISH) != Z_STREAM_END || z->inf.total_out != datasize) {
+        return -1;
+    }
+    *data = buf;
+    *len = datasize;
+    return msgid & ~MSGID_COMPRESSED;
+}
+
+/*-------------------------- 基准测试 --------------------------*/
+
+static inline uint64_t clock_ns(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//拼一条payload：若干条Msgtest记录串起来（类似一次同步多个玩家的状态）
+static int build_payload(unsigned char *buf, int size, uint32_t seed) {
+    int len = 0;
+    unsigned char rec[128];
+    while (len < size) {
+        int n = encode_msgtest(rec, seed++ * 2654435761u >> 8);
+        if (len + n > size) n = size - len;
+        memcpy(buf + len, rec, n);
+        len += n;
+    }
+    return len;
+}
+
+//收一整帧到rbuf，返回帧长
+static int recv_frame(int fd, unsigned char *rbuf) {
+    int got = 0, flen = 2;
+    while (got < flen) {
+        int ret = recv(fd, rbuf + got, flen - got, 0);
+        if (ret <= 0) return -1;
+        got += ret;
+        if (got >= 2) flen = 2 + get_be16(rbuf);
+    }
+    return flen;
+}
+
+/*
+    两端各一个zconn，mode 0：不发ZHELLO（相当于旧对端，不压缩）；
+    mode 1：双方交换ZHELLO但一端不带字典，只做无字典deflate；mode 2：字典id一致，用字典。
+*/
+static int handshake(int mode, int sv[2], struct zconn *tx, struct zconn *rx) {
+    unsigned char buf[FRAME_MAX], ubuf[FRAME_MAX];
+    const unsigned char *data;
+    uint16_t dlen;
+
+    zconn_init(tx, 1);
+    zconn_init(rx, mode == 2);
+    if (mode == 0) {
+        return 0;
+    }
+
+    struct zconn *self[2] = { tx, rx };
+    int i = 0;
+    for (i = 0; i < 2; ++i) {
+        int n = zconn_hello(self[i], buf);
+        if (send(sv[i], buf, n, 0) != n) return -1;
+    }
+    for (i = 0; i < 2; ++i) {
+        //tx从sv[0]收rx的ZHELLO，rx从sv[1]收tx的
+        int n = recv_frame(sv[i], buf);
+        if (n < 0 || frame_decode_body(self[i], buf + 2, n - 2, ubuf, &data, &dlen) != MSG_ZHELLO) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int run(int size, int mode, int sv[2]) {
+    static unsigned char payload[FRAME_MAX], frame[FRAME_MAX], rbuf[FRAME_MAX], ubuf[FRAME_MAX];
+    const int iters = size >= 4096 ? 5000 : 20000;
+
+    struct zconn tx, rx;
+    if (handshake(mode, sv, &tx, &rx) < 0) {
+        return -1;
+    }
+
+    uint64_t wire = 0, cpu = 0, wall = 0;
+    int i = 0;
+    for (i = 0; i < iters; ++i) {
+        int plen = build_payload(payload, size, i * 31);
+
+        uint64_t w0 = clock_ns(CLOCK_MONOTONIC);
+        uint64_t c0 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+        int flen = frame_encode(&tx, frame, 1, payload, (uint16_t)plen);
+        uint64_t c1 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+        //经过socketpair走一遍，延迟里包含两次系统调用和拷贝，不包含真实网络
+        if (send(sv[0], frame, flen, 0) != flen) return -1;
+        int got = 0;
+        while (got < flen) {
+            int ret = recv(sv[1], rbuf + got, flen - got, 0);
+            if (ret <= 0) return -1;
+            got += ret;
+        }
+
+        uint64_t c2 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+        const unsigned char *data;
+        uint16_t dlen;
+        if (frame_decode_body(&rx, rbuf + 2, get_be16(rbuf), ubuf, &data, &dlen) != 1
+            || dlen != plen || memcmp(data, payload, plen) != 0) {
+            fprintf(stderr, "decode mismatch\n");
+            return -1;
+        }
+        uint64_t c3 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+        uint64_t w1 = clock_ns(CLOCK_MONOTONIC);
+
+        wire += flen;
+        cpu += (c1 - c0) + (c3 - c2);
+        wall += w1 - w0;
+    }
+
+    static const char *names[] = { "none", "deflate", "deflate+dict" };
+    printf("%6d %-13s %10.1f %8.3f %12.2f %12.2f\n",
+        size, names[mode],
+        (double)wire / iters,
+        (double)wire / iters / (size + 6),
+        cpu / 1000.0 / iters,
+        wall / 1000.0 / iters);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 2) {
+        if (dict_load(&g_dict, argv[1]) < 0) {
+            fprintf(stderr, "load dict %s failed\n", argv[1]);
+            return -1;
+        }
+    } else {
+        dict_build_from_samples(&g_dict);
+    }
+    printf("dict %u bytes, id %08lx\n", g_dict.len, (unsigned long)g_dict.id);
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        return -2;
+    }
+    int bufsize = 1 << 20;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+    printf("%6s %-13s %10s %8s %12s %12s\n",
+        "size", "mode", "wire(B)", "ratio", "cpu(us)", "latency(us)");
+
+    static const int sizes[] = { 64, 256, 1024, 4096, 16384 };
+    int i = 0, mode = 0;
+    for (i = 0; i < 5; ++i) {
+        for (mode = 0; mode < 3; ++mode) {
+            if (run(sizes[i], mode, sv) < 0) {
+                return -3;
+            }
+        }
+    }
+
+    zctx_release();
+    close(sv[0]);
+    close(sv[1]);
+    return 0;
+}
@@ -0,0 +1,489 @@
+//帧格式扩展：协商开启的32位长度帧 + 大消息流式接收
+
+/*
+    protobuf.c的帧头是2字节bodysize，body最大65535字节。快照、背包全量这类大数据只能在业务层手动拆包、拼包。
+
+    扩展帧格式（big endian）：
+        普通帧（不变）：
+            2 byte bodysize (0 ~ 65534)
+            body: 2 byte msgid + 2 byte datasize + n byte data
+        扩展帧：
+            2 byte 0xFFFF          转义标记
+            4 byte bodysize        32位长度
+            body: 2 byte msgid + n byte data
+            （datasize就是bodysize - 2，不再重复写）
+        小消息仍然是2字节头，一个字节都不多付；只有body超过65534的帧才用8字节的扩展头（比普通帧头多2字节）。
+        代价是bodysize == 65535不能再用普通帧表示，开启扩展后这个长度走扩展帧。
+
+    协商：
+        旧的对端把0xFFFF当成一个65535字节的普通帧，所以不能直接发扩展帧。
+        连接建立后发起方调用frame_start发一个能力帧（msgid FRAME_MSG_CAPS，data是4字节能力位），
+        能力帧由解码器自己处理，不交给on_frame：
+            收到对端能力帧后打开ext（既接受扩展帧，也允许发送扩展帧）；
+            本端还没发过能力帧（caps_sent为0）就回一个，发过了就不再回。
+        两端用的都是这个解码器，每端只发一次能力帧，不会互相应答个没完。
+        收到对端的能力帧之前不允许发送扩展帧，大消息只能由业务层拆包。
+
+    流式接收：
+        扩展帧不会整帧缓存。解码器读到扩展帧头后进入STREAM状态，
+        之后recv到的字节直接以chunk的形式交给on_stream_chunk，解码器自己只保留一个固定大小的接收缓冲区。
+        回调：on_stream_begin(msgid, datasize) -> on_stream_chunk(data, len)* -> on_stream_end()
+        业务层可以边收边解析/边写盘/边算校验，一个100MB的快照也只占用一个接收缓冲区的内存。
+        普通帧仍然整帧回调on_frame，和原来一样。
+
+    编译运行：
+        gcc -O2 -o frame_ext frame_ext.c -lpthread
+        ./frame_ext
+        通过socketpair传输1MB~100MB的消息，对比流式接收与整帧缓存接收的吞吐和内存峰值。
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define FRAME_ESCAPE     0xFFFF
+#define FRAME_MAX_SMALL  0xFFFE
+#define FRAME_MSG_CAPS   0xFFFE  //msgid，能力协商
+#define CAP_EXT_FRAME    0x1
+
+#define RBUF_SIZE        (65535 + 2)
+#define CHUNK_SIZE       (64 * 1024)
+
+static inline uint16_t get_be16(const unsigned char *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void put_be16(unsigned char *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static inline void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+/*-------------------------- 解码 --------------------------*/
+
+enum {
+    FD_HEAD,
+    FD_STREAM,
+};
+
+struct frame_decoder {
+    int fd;         //回复能力帧用
+    int ext;        //对端声明支持扩展帧：接受扩展帧，也允许发送扩展帧
+    int caps_sent;  //本端已经发过能力帧
+    int caps_recv;  //已经收到对端的能力帧
+    int state;
+    uint32_t remain; //STREAM状态下body剩余字节
+
+    void *ud;
+    void (*on_frame)(void *ud, const unsigned char *body, int bodysize);
+    void (*on_stream_begin)(void *ud, uint16_t msgid, uint32_t datasize);
+    void (*on_stream_chunk)(void *ud, const unsigned char *data, uint32_t len);
+    void (*on_stream_end)(void *ud);
+
+    int rlen;
+    unsigned char rbuf[RBUF_SIZE];
+};
+
+static int frame_send_caps(int fd, uint32_t caps);
+
+//发起协商，连接建立后调用一次
+static int frame_start(struct frame_decoder *d) {
+    d->caps_sent = 1;
+    return frame_send_caps(d->fd, CAP_EXT_FRAME);
+}
+
+static void frame_on_caps(struct frame_decoder *d, uint32_t caps) {
+    d->caps_recv = 1;
+    if (caps & CAP_EXT_FRAME) {
+        d->ext = 1;
+    }
+    if (!d->caps_sent) {
+        frame_start(d);
+    }
+}
+
+/*
+    解析rbuf中已有的数据，返回0正常，-1格式错误（应当关闭连接）。
+*/
+static int frame_decode(struct frame_decoder *d) {
+    int off = 0;
+
+    while (1) {
+        int avail = d->rlen - off;
+
+        if (d->state == FD_STREAM) {
+            if (avail == 0) break;
+            uint32_t k = (uint32_t)avail < d->remain ? (uint32_t)avail : d->remain;
+            d->on_stream_chunk(d->ud, d->rbuf + off, k);
+            off += k;
+            d->remain -= k;
+            if (d->remain == 0) {
+                d->on_stream_end(d->ud);
+                d->state = FD_HEAD;
+            }
+            continue;
+        }
+
+        if (avail < 2) break;
+        int bodysize = get_be16(d->rbuf + off);
+
+        if (bodysize == FRAME_ESCAPE && d->ext) {
+            //0xFFFF + 4字节长度 + 2字节msgid
+            if (avail < 8) break;
+            uint32_t total = get_be32(d->rbuf + off + 2);
+            if (total < 2) {
+                return -1;
+            }
+            uint16_t msgid = get_be16(d->rbuf + off + 6);
+            off += 8;
+
+            d->remain = total - 2;
+            d->on_stream_begin(d->ud, msgid, d->remain);
+            if (d->remain == 0) {
+                d->on_stream_end(d->ud);
+            } else {
+                d->state = FD_STREAM;
+            }
+            continue;
+        }
+
+        if (avail < 2 + bodysize) break;
+        const unsigned char *body = d->rbuf + off + 2;
+        if (bodysize >= 8 && get_be16(body) == FRAME_MSG_CAPS) {
+            frame_on_caps(d, get_be32(body + 4));
+        } else {
+            d->on_frame(d->ud, body, bodysize);
+        }
+        off += 2 + bodysize;
+    }
+
+    if (off > 0) {
+        memmove(d->rbuf, d->rbuf + off, d->rlen - off);
+        d->rlen -= off;
+    }
+    return 0;
+}
+
+/*
+    从fd读一次并解码。返回读到的字节数，0对端关闭，-1出错，EAGAIN时errno保留。
+    STREAM状态下缓冲区里不会积压数据（每次都全部交给chunk回调），所以一次recv最多读满一个缓冲区。
+*/
+static int frame_read(struct frame_decoder *d, int fd) {
+    int ret = recv(fd, d->rbuf + d->rlen, RBUF_SIZE - d->rlen, 0);
+    if (ret <= 0) {
+        return ret;
+    }
+    d->rlen += ret;
+    if (frame_decode(d) < 0) {
+        return -1;
+    }
+    return ret;
+}
+
+/*-------------------------- 编码 --------------------------*/
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = (const char*)buf;
+    while (len > 0) {
+        ssize_t ret = send(fd, p, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+//普通帧，同protobuf.c
+static int frame_send(int fd, uint16_t msgid, const void *data, uint16_t len) {
+    unsigned char buf[6 + FRAME_MAX_SMALL];
+    if (len > FRAME_MAX_SMALL - 4) {
+        return -1;
+    }
+    put_be16(buf, len + 4);
+    put_be16(buf + 2, msgid);
+    put_be16(buf + 4, len);
+    memcpy(buf + 6, data, len);
+    return write_all(fd, buf, 6 + len);
+}
+
+static int frame_send_caps(int fd, uint32_t caps) {
+    unsigned char data[4];
+    put_be32(data, caps);
+    return frame_send(fd, FRAME_MSG_CAPS, data, 4);
+}
+
+/*
+    发送一个大消息，数据由produce分块产生，发送方同样不需要把整个消息放在内存里。
+    produce(ud, buf, cap)往buf里写最多cap字节，返回写入的字节数。
+    peer_ext为0（对端没有声明支持扩展帧）时拒绝发送，由业务层自己拆包。
+*/
+static int frame_send_stream(int fd, int peer_ext, uint16_t msgid, uint32_t datasize,
+    size_t (*produce)(void *ud, unsigned char *buf, size_t cap), void *ud) {
+
+    if ((uint64_t)datasize + 4 <= FRAME_MAX_SMALL) {
+        unsigned char data[FRAME_MAX_SMALL];
+        size_t n = 0;
+        while (n < datasize) {
+            n += produce(ud, data + n, datasize - n);
+        }
+        return frame_send(fd, msgid, data, (uint16_t)datasize);
+    }
+
+    if (!peer_ext || datasize > UINT32_MAX - 2) {
+        return -1;
+    }
+
+    static __thread unsigned char chunk[CHUNK_SIZE];
+    put_be16(chunk, FRAME_ESCAPE);
+    put_be32(chunk + 2, datasize + 2);
+    put_be16(chunk + 6, msgid);
+    if (write_all(fd, chunk, 8) < 0) {
+        return -1;
+    }
+
+    uint32_t left = datasize;
+    while (left > 0) {
+        size_t n = produce(ud, chunk, left < CHUNK_SIZE ? left : CHUNK_SIZE);
+        if (write_all(fd, chunk, n) < 0) {
+            return -1;
+        }
+        left -= n;
+    }
+    return 0;
+}
+
+/*-------------------------- 基准测试 --------------------------*/
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//VmHWM：进程物理内存峰值(KB)
+static long peak_rss_kb(void) {
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (!fp) {
+        return -1;
+    }
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "VmHWM:", 6) == 0) {
+            kb = atol(line + 6);
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+//把VmHWM重置为当前RSS（Linux 4.0+），每组测试单独统计峰值
+static void reset_peak_rss(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        ssize_t ret = write(fd, "5", 1);
+        (void)ret;
+        close(fd);
+    }
+}
+
+struct sender {
+    int fd;
+    uint32_t size;
+    int count;
+    uint32_t seed;
+};
+
+static size_t produce_bytes(void *ud, unsigned char *buf, size_t cap) {
+    struct sender *s = (struct sender*)ud;
+    size_t i = 0;
+    for (i = 0; i < cap; ++i) {
+        buf[i] = (unsigned char)(s->seed++ * 131);
+    }
+    return cap;
+}
+
+//协商阶段对端不会发业务帧
+static void tx_ignore_frame(void *ud, const unsigned char *body, int bodysize) {
+    (void)ud;
+    (void)body;
+    (void)bodysize;
+}
+
+static void *sender_loop(void *arg) {
+    struct sender *s = (struct sender*)arg;
+
+    //先协商，收到对端的能力帧再发扩展帧。对端的应答同样经过解码器
+    struct frame_decoder *d = (struct frame_decoder*)calloc(1, sizeof(struct frame_decoder));
+    if (!d) {
+        return NULL;
+    }
+    d->fd = s->fd;
+    d->ud = s;
+    d->on_frame = tx_ignore_frame;
+    frame_start(d);
+    while (!d->caps_recv) {
+        int ret = frame_read(d, s->fd);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) continue;
+            free(d);
+            return NULL;
+        }
+    }
+
+    int i = 0;
+    for (i = 0; i < s->count; ++i) {
+        if (frame_send_stream(s->fd, d->ext, 1, s->size, produce_bytes, s) < 0) {
+            break;
+        }
+    }
+    free(d);
+    return NULL;
+}
+
+struct receiver {
+    struct frame_decoder dec;
+    int fd;
+    int buffered;   //1：对照组，整帧拼好再处理
+    int done;
+    uint64_t sum;
+    uint64_t bytes;
+
+    unsigned char *whole;
+    uint32_t wlen;
+    size_t peak_buf; //接收方自己持有的消息缓冲峰值
+};
+
+static void rx_frame(void *ud, const unsigned char *body, int bodysize) {
+    struct receiver *r = (struct receiver*)ud;
+    (void)body;
+    (void)bodysize;
+    r->done++;
+}
+
+static void rx_begin(void *ud, uint16_t msgid, uint32_t datasize) {
+    struct receiver *r = (struct receiver*)ud;
+    (void)msgid;
+    if (r->buffered) {
+        r->whole = (unsigned char*)malloc(datasize);
+        r->wlen = 0;
+        if (datasize > r->peak_buf) r->peak_buf = datasize;
+    }
+}
+
+static void rx_chunk(void *ud, const unsigned char *data, uint32_t len) {
+    struct receiver *r = (struct receiver*)ud;
+    r->bytes += len;
+    if (r->buffered) {
+        memcpy(r->whole + r->wlen, data, len);
+        r->wlen += len;
+        return;
+    }
+    //流式：边收边处理
+    uint32_t i = 0;
+    for (i = 0; i < len; i += 64) {
+        r->sum += data[i];
+    }
+}
+
+static void rx_end(void *ud) {
+    struct receiver *r = (struct receiver*)ud;
+    if (r->buffered) {
+        uint32_t i = 0;
+        for (i = 0; i < r->wlen; i += 64) {
+            r->sum += r->whole[i];
+        }
+        free(r->whole);
+        r->whole = NULL;
+    }
+    r->done++;
+}
+
+static int run(uint32_t size, int count, int buffered) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        return -1;
+    }
+
+    struct receiver *r = (struct receiver*)calloc(1, sizeof(struct receiver));
+    r->fd = sv[0];
+    r->buffered = buffered;
+    r->peak_buf = RBUF_SIZE;
+    r->dec.fd = sv[0];
+    r->dec.ud = r;
+    r->dec.on_frame = rx_frame;
+    r->dec.on_stream_begin = rx_begin;
+    r->dec.on_stream_chunk = rx_chunk;
+    r->dec.on_stream_end = rx_end;
+
+    struct sender s = { sv[1], size, count, 1 };
+
+    reset_peak_rss();
+    long base_kb = peak_rss_kb();
+
+    uint64_t start = now_ns();
+    pthread_t tid;
+    pthread_create(&tid, NULL, sender_loop, &s);
+
+    while (r->done < count) {
+        int ret = frame_read(&r->dec, r->fd);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) continue;
+            break;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    pthread_join(tid, NULL);
+
+    long peak_kb = peak_rss_kb();
+    printf("%-9s %8.0fMB %6d %10.0f %14.1f %14.1f\n",
+        buffered ? "buffered" : "stream",
+        size / 1048576.0, count,
+        (double)r->bytes * 1e3 / elapsed,
+        r->peak_buf / 1048576.0,
+        base_kb >= 0 && peak_kb >= 0 ? (peak_kb - base_kb) / 1024.0 : -1.0);
+
+    close(sv[0]);
+    close(sv[1]);
+    free(r);
+    return 0;
+}
+
+int main(void) {
+    static const uint32_t sizes[] = { 1 << 20, 10 << 20, 100 << 20 };
+    static const int counts[] = { 50, 10, 2 };
+
+    printf("%-9s %10s %6s %10s %14s %14s\n",
+        "mode", "size", "count", "MB/s", "rx buf(MB)", "rss peak(MB)");
+
+    int buffered = 0, i = 0;
+    for (buffered = 0; buffered < 2; ++buffered) {
+        for (i = 0; i < 3; ++i) {
+            if (run(sizes[i], counts[i], buffered) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
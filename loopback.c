@@ -0,0 +1,1004 @@
+//进程内loopback传输：SPSC字节环冒充socket，通过eventpoll.h的回调报告就绪
+
+/*
+    用epoll.c测服务器，每条消息都要经过内核TCP：send/recv系统调用、协议栈、loopback网卡、epoll_wait，
+    框架自己（帧解析、分发、输出队列）花了多少时间被这些淹没了，结果也跟机器负载有关，没法复现。
+
+    epoll_principle.c讲过，TCP协议栈在4个时机调用epoll_event_callback：
+        1.三次握手完成（accept队列有连接）  2.收到数据  3.发送缓冲区有空间  4.收到FIN
+    eventpoll.h把eventpoll搬到了用户态，这里再把“协议栈”也换掉：
+        一个连接 = 两个单生产者单消费者(SPSC)的字节环，一个方向一个，每端一个lb_sock；
+        lb_send往对端的接收环里写，环从空变非空时调用对端eventpoll的ep_event_callback(EPOLLIN)，对应时机2；
+        lb_recv从环里读，环原来是满的就通知对端EPOLLOUT，对应时机3；
+        lb_close通知对端EPOLLIN|EPOLLRDHUP|EPOLLHUP，对应时机4；
+        连接由lb_socketpair直接创建，时机1没有用到。
+    lb_send/lb_recv/lb_close的返回值和errno与send/recv/close一致（EAGAIN、EPIPE、返回0表示对端关闭），
+    服务器代码除了函数名以外和走内核的版本一样。
+
+    SPSC字节环：
+        head只由生产者写，tail只由消费者写，都是不回绕的32位计数，下标取低位，容量是2的幂；
+        数据先memcpy进去再release head，消费者acquire head之后读，没有锁也没有CAS。
+        “空->非空”的通知不能丢：生产者store head后再load tail，消费者store tail后再load head（都是seq_cst），
+        两边至少有一方能看到对方的更新，生产者看到tail == 写之前的head就通知，否则消费者一定会读到新数据。
+        通知时重新计算当前完整的就绪状态交给ep_event_callback，回调之后再算一次，变了就再报一次。
+        两个线程同时通知同一个socket时，先算后报的那个可能把revents覆盖成旧值，但它回调之后的重算
+        （ep->lock保证了先后）一定能看到对方的更新，会把revents纠正回来。
+        这里不能用锁把“计算+回调”包起来：回调里会唤醒ep_wait，单核上被唤醒的线程抢占之后
+        去拿同一把自旋锁，要空转一整个时间片。
+
+    因为不碰内核，这个传输也适合做kernel bypass（DPDK/RDMA等）的替身：
+        服务器只依赖“send/recv + 就绪回调”这个接口，换成网卡队列的实现不用改框架代码。
+
+    两种测试：
+        det：单线程确定性测试，客户端和服务器轮流推进。
+             每个客户端用固定种子生成随机长度的请求，并把字节流随机切成小段写入（帧会被拆开），
+             校验每个回包的内容，输出所有回包的校验和；同一种子跑两遍校验和必须一样。
+             只给服务器那部分计时，得到框架本身每条消息的开销。
+        bench：客户端和服务器各一个线程，闭环ping-pong，每个连接最多WINDOW个请求在途，输出吞吐。
+             服务器常开1/PROF_EVERY采样的分段计时（prof.h），kill -USR1输出各阶段直方图和最慢的消息。
+        prof：det的负载关闭/打开采样交替跑PROF_ROUNDS轮，比较服务器每条消息耗时的中位数，并给出抖动范围；
+             另外单独测一条trace的成本乘上采样数，直接估算开销（A/B对比分辨不了抖动以内的差别）。
+             最后输出一次prof_dump。
+
+    编译运行：
+        gcc -O2 -o loopback loopback.c -lpthread
+        ./loopback det [种子]
+        ./loopback bench [连接数]
+        kill -USR1 `pidof loopback`
+        ./loopback prof [采样间隔N]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "eventpoll.h"
+#include "prof.h"
+
+#define LB_RING_SIZE    (64 * 1024)    //2的幂
+#define LB_MAX_FD       4096
+
+#define RBUF_SIZE       (65535 + 2)
+#define MAX_MSGID       1024
+#define MSG_ECHO        1
+#define MAX_EVENTS      256
+#define PROF_EVERY      64
+
+/*-------------------------- SPSC字节环 --------------------------*/
+
+struct lb_ring {
+    _Atomic uint32_t head;  //生产者写
+    char pad0[64 - sizeof(uint32_t)];
+    _Atomic uint32_t tail;  //消费者写
+    char pad1[64 - sizeof(uint32_t)];
+    unsigned char buf[LB_RING_SIZE];
+};
+
+//返回写入的字节数，*was_empty表示写之前消费者已经读空，需要通知
+static int ring_write(struct lb_ring *r, const unsigned char *data, int len, int *was_empty) {
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    uint32_t space = LB_RING_SIZE - (head - tail);
+    uint32_t n = (uint32_t)len < space ? (uint32_t)len : space;
+
+    *was_empty = 0;
+    if (n == 0) {
+        return 0;
+    }
+
+    uint32_t off = head & (LB_RING_SIZE - 1);
+    uint32_t first = n < LB_RING_SIZE - off ? n : LB_RING_SIZE - off;
+    memcpy(r->buf + off, data, first);
+    memcpy(r->buf, data + first, n - first);
+
+    atomic_store_explicit(&r->head, head + n, memory_order_seq_cst);
+    *was_empty = atomic_load_explicit(&r->tail, memory_order_seq_cst) == head;
+    return n;
+}
+
+//返回读出的字节数，*was_full表示读之前是满的，生产者可能在等EPOLLOUT
+static int ring_read(struct lb_ring *r, unsigned char *data, int len, int *was_full) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint32_t avail = head - tail;
+    uint32_t n = (uint32_t)len < avail ? (uint32_t)len : avail;
+
+    *was_full = 0;
+    if (n == 0) {
+        return 0;
+    }
+
+    uint32_t off = tail & (LB_RING_SIZE - 1);
+    uint32_t first = n < LB_RING_SIZE - off ? n : LB_RING_SIZE - off;
+    memcpy(data, r->buf + off, first);
+    memcpy(data + first, r->buf, n - first);
+
+    atomic_store_explicit(&r->tail, tail + n, memory_order_seq_cst);
+    *was_full = atomic_load_explicit(&r->head, memory_order_seq_cst) - tail >= LB_RING_SIZE;
+    return n;
+}
+
+static inline int ring_empty(struct lb_ring *r) {
+    return atomic_load_explicit(&r->head, memory_order_acquire) == atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+static inline int ring_full(struct lb_ring *r) {
+    return atomic_load_explicit(&r->head, memory_order_acquire) - atomic_load_explicit(&r->tail, memory_order_acquire) >= LB_RING_SIZE;
+}
+
+/*-------------------------- loopback socket --------------------------*/
+
+struct lb_sock {
+    int fd;
+    struct lb_ring *rx;
+    struct lb_ring *tx;  //就是对端的rx
+    struct lb_sock *peer;
+
+    struct eventpoll *_Atomic ep;  //注册到的eventpoll，相当于内核socket上挂的ep_poll_callback
+
+    atomic_int peer_closed;
+    int closed;
+
+    _Atomic uint64_t rx_ready;  //rx从空变成非空的时刻（prof_now），相当于协议栈把fd挂进rdlist的时间
+};
+
+static struct lb_sock *g_socks[LB_MAX_FD];
+static int g_nsocks;
+
+static inline struct lb_sock *lb_get(int fd) {
+    if (fd < 0 || fd >= g_nsocks || !g_socks[fd] || g_socks[fd]->closed) {
+        errno = EBADF;
+        return NULL;
+    }
+    return g_socks[fd];
+}
+
+//相当于协议栈对socket的poll：当前的完整就绪状态
+static uint32_t lb_poll(struct lb_sock *s) {
+    uint32_t ev = 0;
+    int peer_closed = atomic_load(&s->peer_closed);
+    if (!ring_empty(s->rx)) ev |= EPOLLIN;
+    if (peer_closed) ev |= EPOLLIN | EPOLLRDHUP | EPOLLHUP;
+    if (!ring_full(s->tx) || peer_closed) ev |= EPOLLOUT; //对端关了也报可写，让写的人拿到EPIPE
+    return ev;
+}
+
+static void lb_notify(struct lb_sock *s) {
+    struct eventpoll *ep = atomic_load(&s->ep);
+    if (!ep) {
+        return;
+    }
+    uint32_t ev = lb_poll(s), now = 0;
+    while (1) {
+        ep_event_callback(ep, s->fd, ev);
+        now = lb_poll(s);
+        if (now == ev) break;
+        ev = now;
+    }
+}
+
+//和socketpair一样，fds[0]和fds[1]是一个连接的两端
+static int lb_socketpair(int fds[2]) {
+    if (g_nsocks + 2 > LB_MAX_FD) {
+        errno = EMFILE;
+        return -1;
+    }
+    struct lb_sock *a = (struct lb_sock*)calloc(1, sizeof(struct lb_sock));
+    struct lb_sock *b = (struct lb_sock*)calloc(1, sizeof(struct lb_sock));
+    struct lb_ring *ra = (struct lb_ring*)aligned_alloc(64, sizeof(struct lb_ring));
+    struct lb_ring *rb = (struct lb_ring*)aligned_alloc(64, sizeof(struct lb_ring));
+    if (!a || !b || !ra || !rb) {
+        free(a);
+        free(b);
+        free(ra);
+        free(rb);
+        errno = ENOMEM;
+        return -1;
+    }
+    atomic_init(&ra->head, 0);
+    atomic_init(&ra->tail, 0);
+    atomic_init(&rb->head, 0);
+    atomic_init(&rb->tail, 0);
+
+    a->rx = ra;
+    a->tx = rb;
+    a->peer = b;
+    b->rx = rb;
+    b->tx = ra;
+    b->peer = a;
+
+    a->fd = g_nsocks++;
+    b->fd = g_nsocks++;
+    g_socks[a->fd] = a;
+    g_socks[b->fd] = b;
+    fds[0] = a->fd;
+    fds[1] = b->fd;
+    return 0;
+}
+
+//注册到eventpoll，和内核ep_insert一样注册时先poll一次，已经就绪的立刻进rdlist
+static int lb_epoll_add(struct eventpoll *ep, int fd, uint32_t events) {
+    struct lb_sock *s = lb_get(fd);
+    if (!s) {
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    if (ep_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        return -1;
+    }
+    atomic_store(&s->ep, ep);
+    lb_notify(s);
+    return 0;
+}
+
+static int lb_send(int fd, const void *buf, int len) {
+    struct lb_sock *s = lb_get(fd);
+    if (!s) {
+        return -1;
+    }
+    if (atomic_load(&s->peer_closed)) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    //在数据对对端可见之前记下就绪时刻，对端读到数据时一定能看到这个值（prof的PP_ARRIVE）
+    if (PROF_ENABLED && ring_empty(s->tx)) {
+        atomic_store_explicit(&s->peer->rx_ready, prof_now(), memory_order_relaxed);
+    }
+
+    int was_empty = 0;
+    int n = ring_write(s->tx, (const unsigned char*)buf, len, &was_empty);
+    if (was_empty) {
+        lb_notify(s->peer);     //时机2：对端收到数据
+    }
+    if (n < len) {
+        lb_notify(s);           //写满了，刷新自己的状态（LT下不再报EPOLLOUT）
+    }
+    if (n == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return n;
+}
+
+static int lb_recv(int fd, void *buf, int len) {
+    struct lb_sock *s = lb_get(fd);
+    if (!s) {
+        return -1;
+    }
+
+    int was_full = 0;
+    int n = ring_read(s->rx, (unsigned char*)buf, len, &was_full);
+    if (was_full) {
+        lb_notify(s->peer);     //时机3：对端发送缓冲区有空间了
+    }
+    if (n > 0) {
+        return n;
+    }
+    if (atomic_load(&s->peer_closed) && ring_empty(s->rx)) {
+        return 0;
+    }
+    lb_notify(s);               //读空了，刷新自己的状态（LT下不再报EPOLLIN）
+    errno = EAGAIN;
+    return -1;
+}
+
+//调用者负责先从eventpoll删除，和epoll一样
+static int lb_close(int fd) {
+    struct lb_sock *s = lb_get(fd);
+    if (!s) {
+        return -1;
+    }
+    s->closed = 1;
+    atomic_store(&s->ep, NULL);
+
+    atomic_store(&s->peer->peer_closed, 1);
+    lb_notify(s->peer);         //时机4：对端收到FIN
+    return 0;
+}
+
+//两端都关闭之后才能释放环，测试结束时统一回收
+static void lb_cleanup(void) {
+    int i = 0;
+    for (i = 0; i < g_nsocks; i += 2) {
+        free(g_socks[i]->rx);
+        free(g_socks[i]->tx);
+        free(g_socks[i]);
+        free(g_socks[i + 1]);
+        g_socks[i] = g_socks[i + 1] = NULL;
+    }
+    g_nsocks = 0;
+}
+
+/*-------------------------- 服务器：帧解析 + 分发 + 输出 --------------------------*/
+
+struct server;
+struct conn;
+
+typedef int (*msg_handler)(struct server *s, struct conn *c, const unsigned char *data, uint16_t len);
+
+struct conn {
+    int fd;
+    int want_out; //当前是否注册了EPOLLOUT
+
+    int rlen;
+    unsigned char *rbuf;
+
+    unsigned char *wbuf;
+    int woff, wlen, wcap;
+};
+
+struct server {
+    struct eventpoll *ep;
+    int nconn;
+    struct conn *conns[LB_MAX_FD];
+    msg_handler handlers[MAX_MSGID];
+
+    unsigned long frames;
+
+    struct prof prof;
+    struct prof_trace *tr;  //当前事件被采样时非NULL
+    struct conn *tr_conn;   //被采样的回包所在的连接，写完后清空
+    int tr_wend;            //被采样的回包在tr_conn->wbuf里的结束位置，woff越过它时记PP_WRITE
+};
+
+//信号可能落在任意线程上，由服务器线程轮询，用无锁的atomic_int而不是volatile
+static atomic_int g_prof_dump;
+
+static void on_sigusr1(int sig) {
+    (void)sig;
+    atomic_store(&g_prof_dump, 1);
+}
+
+static void conn_close(struct server *s, struct conn *c) {
+    if (PROF_ENABLED && s->tr_conn == c) {
+        s->tr_conn = NULL;
+    }
+    ep_ctl(s->ep, EPOLL_CTL_DEL, c->fd, NULL);
+    lb_close(c->fd);
+    s->conns[c->fd] = NULL;
+    s->nconn--;
+    free(c->rbuf);
+    free(c->wbuf);
+    free(c);
+}
+
+static struct conn *conn_add(struct server *s, int fd) {
+    struct conn *c = (struct conn*)calloc(1, sizeof(struct conn));
+    if (c) {
+        c->rbuf = (unsigned char*)malloc(RBUF_SIZE);
+    }
+    if (!c || !c->rbuf) {
+        free(c);
+        lb_close(fd);
+        return NULL;
+    }
+    c->fd = fd;
+    s->conns[fd] = c;
+    s->nconn++;
+    lb_epoll_add(s->ep, fd, EPOLLIN | EPOLLET);
+    return c;
+}
+
+static void conn_update_events(struct server *s, struct conn *c) {
+    int want = c->wlen > c->woff;
+    if (want == c->want_out) {
+        return;
+    }
+    c->want_out = want;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET | (want ? EPOLLOUT : 0);
+    ev.data.fd = c->fd;
+    ep_ctl(s->ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static int conn_flush(struct server *s, struct conn *c) {
+    int traced = PROF_ENABLED && s->tr_conn == c;
+    if (traced) {
+        prof_mark(s->tr, PP_FLUSH);
+    }
+    while (c->wlen > c->woff) {
+        int ret = lb_send(c->fd, c->wbuf + c->woff, c->wlen - c->woff);
+        if (ret < 0) {
+            if (errno == EAGAIN) break;
+            conn_close(s, c);
+            return -1;
+        }
+        c->woff += ret;
+    }
+    //没写完的留到EPOLLOUT，那时已经是另一个事件，这条trace按dropped计
+    if (traced && c->woff >= s->tr_wend) {
+        prof_mark(s->tr, PP_WRITE);
+        s->tr_conn = NULL;
+    }
+    if (c->woff == c->wlen) {
+        c->woff = c->wlen = 0;
+    }
+    conn_update_events(s, c);
+    return 0;
+}
+
+//只追加到输出队列，一次读事件里的所有回包最后统一flush
+static int conn_send_frame(struct server *s, struct conn *c, uint16_t msgid, const unsigned char *data, uint16_t len) {
+    int need = 6 + len;
+    if (c->wlen + need > c->wcap && c->woff > 0) {
+        memmove(c->wbuf, c->wbuf + c->woff, c->wlen - c->woff);
+        c->wlen -= c->woff;
+        if (PROF_ENABLED && s->tr_conn == c) {
+            s->tr_wend -= c->woff;
+        }
+        c->woff = 0;
+    }
+    if (c->wlen + need > c->wcap) {
+        int cap = c->wcap ? c->wcap : 4096;
+        while (cap < c->wlen + need) cap *= 2;
+        unsigned char *p = (unsigned char*)realloc(c->wbuf, cap);
+        if (!p) {
+            return -1;
+        }
+        c->wbuf = p;
+        c->wcap = cap;
+    }
+
+    unsigned char *p = c->wbuf + c->wlen;
+    p[0] = (len + 4) >> 8;
+    p[1] = (len + 4) & 0xff;
+    p[2] = msgid >> 8;
+    p[3] = msgid & 0xff;
+    p[4] = len >> 8;
+    p[5] = len & 0xff;
+    memcpy(p + 6, data, len);
+    c->wlen += need;
+    if (PROF_ENABLED && s->tr && !s->tr->t[PP_ENQUEUE]) {
+        s->tr_conn = c;
+        s->tr_wend = c->wlen;
+    }
+    prof_mark(s->tr, PP_ENQUEUE);
+    return 0;
+}
+
+static int on_echo(struct server *s, struct conn *c, const unsigned char *data, uint16_t len) {
+    return conn_send_frame(s, c, MSG_ECHO, data, len);
+}
+
+//按帧切分并分发，返回-1表示连接要关闭
+static int conn_dispatch(struct server *s, struct conn *c) {
+    int off = 0;
+    while (c->rlen - off >= 2) {
+        int bodysize = (c->rbuf[off] << 8) | c->rbuf[off + 1];
+        if (c->rlen - off < 2 + bodysize) break;
+
+        const unsigned char *body = c->rbuf + off + 2;
+        if (bodysize < 4) {
+            return -1;
+        }
+        uint16_t msgid = (body[0] << 8) | body[1];
+        uint16_t datasize = (body[2] << 8) | body[3];
+        if (PROF_ENABLED && s->tr && !s->tr->t[PP_DECODE]) {
+            s->tr->msgid = msgid;
+        }
+        prof_mark(s->tr, PP_DECODE);
+
+        if (datasize > bodysize - 4 || msgid >= MAX_MSGID || !s->handlers[msgid]) {
+            return -1;
+        }
+        msg_handler h = s->handlers[msgid];
+        prof_mark(s->tr, PP_DISPATCH);
+        if (h(s, c, body + 4, datasize) < 0) {
+            return -1;
+        }
+        s->frames++;
+        off += 2 + bodysize;
+    }
+    if (off > 0) {
+        memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+        c->rlen -= off;
+    }
+    return 0;
+}
+
+//ET：读到EAGAIN为止
+static void conn_read(struct server *s, struct conn *c) {
+    while (1) {
+        int ret = lb_recv(c->fd, c->rbuf + c->rlen, RBUF_SIZE - c->rlen);
+        if (ret < 0) {
+            if (errno == EAGAIN) break;
+            conn_close(s, c);
+            return;
+        }
+        if (ret == 0) {
+            conn_close(s, c);
+            return;
+        }
+        c->rlen += ret;
+        prof_mark(s->tr, PP_READ);
+        if (conn_dispatch(s, c) < 0) {
+            conn_close(s, c);
+            return;
+        }
+    }
+    conn_flush(s, c);
+}
+
+//处理一轮就绪事件，返回处理的事件数
+static int server_poll(struct server *s, int timeout) {
+    if (atomic_load_explicit(&g_prof_dump, memory_order_relaxed) && atomic_exchange(&g_prof_dump, 0)) {
+        prof_dump(&s->prof, stderr, 10);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int nready = ep_wait(s->ep, events, MAX_EVENTS, timeout);
+    uint64_t wake = prof_wake(&s->prof, nready);
+    int i = 0;
+    for (i = 0; i < nready; ++i) {
+        struct conn *c = s->conns[events[i].data.fd];
+        if (!c) continue;
+
+        s->tr = prof_begin(&s->prof, c->fd);
+        if (PROF_ENABLED && s->tr) {
+            //就绪时刻取自协议栈；读到的是这批事件之后又一次变成就绪的时刻时，按epoll_wait返回时算
+            uint64_t arrive = atomic_load_explicit(&g_socks[c->fd]->rx_ready, memory_order_relaxed);
+            prof_set(s->tr, PP_WAKE, wake);
+            prof_set(s->tr, PP_ARRIVE, arrive && arrive <= wake ? arrive : wake);
+        }
+        if (events[i].events & EPOLLOUT) {
+            if (conn_flush(s, c) < 0) {
+                s->tr = NULL;
+                s->tr_conn = NULL;
+                continue;
+            }
+        }
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            conn_read(s, c);
+        }
+        prof_end(&s->prof, s->tr);
+        s->tr = NULL;
+        s->tr_conn = NULL;
+    }
+    return nready;
+}
+
+//prof_every为0时不采样
+static int server_init(struct server *s, uint32_t prof_every) {
+    memset(s, 0, sizeof(*s));
+    s->ep = ep_create();
+    if (!s->ep) {
+        return -1;
+    }
+    s->handlers[MSG_ECHO] = on_echo;
+    prof_init(&s->prof, prof_every);
+    return 0;
+}
+
+static void server_destroy(struct server *s) {
+    int i = 0;
+    for (i = 0; i < LB_MAX_FD; ++i) {
+        if (s->conns[i]) conn_close(s, s->conns[i]);
+    }
+    ep_destroy(s->ep);
+}
+
+/*-------------------------- 合成客户端 --------------------------*/
+
+struct client {
+    int fd;
+    uint32_t rng;
+    uint32_t seq_sent;
+    uint32_t seq_recv;
+    uint32_t total;     //要发的请求数
+    int window;         //最多在途请求数
+    int max_chunk;      //>0时把字节流随机切成不超过这么长的段写入
+
+    unsigned char obuf[RBUF_SIZE];
+    int ooff, olen;
+
+    int rlen;
+    unsigned char rbuf[RBUF_SIZE];
+
+    unsigned long errors;
+    uint64_t checksum;
+};
+
+static inline uint32_t xorshift32(uint32_t *s) {
+    uint32_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *s = x;
+}
+
+//请求内容由seq和长度决定，回包可以直接重新生成来校验
+static inline unsigned char payload_byte(uint32_t seq, int i) {
+    return (unsigned char)(seq * 131 + i * 7);
+}
+
+static void client_queue_request(struct client *cl, int len) {
+    if (cl->ooff > 0) {
+        memmove(cl->obuf, cl->obuf + cl->ooff, cl->olen - cl->ooff);
+        cl->olen -= cl->ooff;
+        cl->ooff = 0;
+    }
+    unsigned char *p = cl->obuf + cl->olen;
+    uint32_t seq = cl->seq_sent++;
+    p[0] = (len + 4) >> 8;
+    p[1] = (len + 4) & 0xff;
+    p[2] = MSG_ECHO >> 8;
+    p[3] = MSG_ECHO & 0xff;
+    p[4] = len >> 8;
+    p[5] = len & 0xff;
+    int i = 0;
+    for (i = 0; i < len; ++i) {
+        p[6 + i] = payload_byte(seq, i);
+    }
+    cl->olen += 6 + len;
+}
+
+static void client_flush(struct client *cl) {
+    while (cl->olen > cl->ooff) {
+        int n = cl->olen - cl->ooff;
+        if (cl->max_chunk > 0) {
+            int chunk = 1 + (int)(xorshift32(&cl->rng) % cl->max_chunk);
+            if (chunk < n) n = chunk;
+        }
+        int ret = lb_send(cl->fd, cl->obuf + cl->ooff, n);
+        if (ret < 0) break;
+        cl->ooff += ret;
+    }
+}
+
+//窗口有空位就补请求
+static void client_fill(struct client *cl, int min_len, int max_len) {
+    while (cl->seq_sent < cl->total && (int)(cl->seq_sent - cl->seq_recv) < cl->window
+           && cl->olen + 6 + max_len <= RBUF_SIZE) {
+        int len = min_len + (int)(xorshift32(&cl->rng) % (max_len - min_len + 1));
+        client_queue_request(cl, len);
+    }
+    client_flush(cl);
+}
+
+static void client_read(struct client *cl) {
+    while (1) {
+        int ret = lb_recv(cl->fd, cl->rbuf + cl->rlen, RBUF_SIZE - cl->rlen);
+        if (ret <= 0) break;
+        cl->rlen += ret;
+
+        int off = 0;
+        while (cl->rlen - off >= 6) {
+            int bodysize = (cl->rbuf[off] << 8) | cl->rbuf[off + 1];
+            if (cl->rlen - off < 2 + bodysize) break;
+            const unsigned char *body = cl->rbuf + off + 2;
+            int len = (body[2] << 8) | body[3];
+
+            uint32_t seq = cl->seq_recv++;
+            int i = 0;
+            for (i = 0; i < len; ++i) {
+                if (body[4 + i] != payload_byte(seq, i)) {
+                    cl->errors++;
+                    break;
+                }
+            }
+            cl->checksum = (cl->checksum ^ ((uint64_t)seq << 16 ^ (uint64_t)len)) * 0x100000001b3ull;
+            off += 2 + bodysize;
+        }
+        if (off > 0) {
+            memmove(cl->rbuf, cl->rbuf + off, cl->rlen - off);
+            cl->rlen -= off;
+        }
+    }
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int connect_clients(struct server *s, struct eventpoll *cep, struct client *cls, int n) {
+    int i = 0;
+    for (i = 0; i < n; ++i) {
+        int fds[2];
+        if (lb_socketpair(fds) < 0) {
+            return -1;
+        }
+        cls[i].fd = fds[0];
+        if (!conn_add(s, fds[1]) || lb_epoll_add(cep, fds[0], EPOLLIN | EPOLLET) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*-------------------------- det：单线程确定性测试 --------------------------*/
+
+#define DET_CLIENTS     64
+#define DET_REQUESTS    2000
+
+struct det_result {
+    uint64_t checksum;
+    unsigned long frames;
+    unsigned long errors;
+    uint64_t server_ns;
+    uint64_t total_ns;
+};
+
+//prof_out不为NULL时把服务器的采样结果拷出来
+static int det_run(uint32_t seed, uint32_t prof_every, struct prof *prof_out, struct det_result *res) {
+    static struct server s;
+    if (server_init(&s, prof_every) < 0) {
+        return -1;
+    }
+    struct eventpoll *cep = ep_create();
+    struct client *cls = (struct client*)calloc(DET_CLIENTS, sizeof(struct client));
+    if (!cep || !cls || connect_clients(&s, cep, cls, DET_CLIENTS) < 0) {
+        return -1;
+    }
+
+    int i = 0;
+    for (i = 0; i < DET_CLIENTS; ++i) {
+        cls[i].rng = seed * 2654435761u + i + 1;
+        cls[i].total = DET_REQUESTS;
+        cls[i].window = 1 + (int)(xorshift32(&cls[i].rng) % 32);
+        cls[i].max_chunk = 1 + (int)(xorshift32(&cls[i].rng) % 512);
+    }
+
+    memset(res, 0, sizeof(*res));
+    uint64_t start = now_ns();
+    int done = 0;
+    while (done < DET_CLIENTS) {
+        for (i = 0; i < DET_CLIENTS; ++i) {
+            client_fill(&cls[i], 0, 1024);
+        }
+
+        //服务器跑到没有就绪事件为止，只有这段计时
+        uint64_t t0 = now_ns();
+        while (server_poll(&s, 0) > 0);
+        res->server_ns += now_ns() - t0;
+
+        struct epoll_event events[MAX_EVENTS];
+        int nready = 0;
+        while ((nready = ep_wait(cep, events, MAX_EVENTS, 0)) > 0) {
+            int j = 0;
+            for (j = 0; j < nready; ++j) {
+                int fd = events[j].data.fd;
+                //client的fd都是偶数，第k个客户端是2k
+                client_read(&cls[fd / 2]);
+            }
+        }
+
+        done = 0;
+        for (i = 0; i < DET_CLIENTS; ++i) {
+            if (cls[i].seq_recv == cls[i].total) done++;
+        }
+    }
+    res->total_ns = now_ns() - start;
+
+    res->frames = s.frames;
+    for (i = 0; i < DET_CLIENTS; ++i) {
+        res->errors += cls[i].errors;
+        res->checksum = (res->checksum ^ cls[i].checksum) * 0x100000001b3ull;
+        ep_ctl(cep, EPOLL_CTL_DEL, cls[i].fd, NULL);
+        lb_close(cls[i].fd);
+    }
+    //客户端关闭后服务器应该看到HUP把连接全部关掉
+    while (s.nconn > 0 && server_poll(&s, 0) > 0);
+    if (s.nconn != 0) {
+        res->errors++;
+    }
+
+    if (prof_out) {
+        memcpy(prof_out, &s.prof, sizeof(struct prof));
+    }
+    server_destroy(&s);
+    ep_destroy(cep);
+    free(cls);
+    lb_cleanup();
+    return 0;
+}
+
+static int det_test(uint32_t seed) {
+    struct det_result r1, r2;
+    if (det_run(seed, 0, NULL, &r1) < 0 || det_run(seed, 0, NULL, &r2) < 0) {
+        printf("det run failed\n");
+        return -1;
+    }
+    printf("seed %u: %d clients x %d requests, %lu frames, %lu errors\n",
+           seed, DET_CLIENTS, DET_REQUESTS, r1.frames, r1.errors + r2.errors);
+    printf("checksum %016llx / %016llx %s\n", (unsigned long long)r1.checksum, (unsigned long long)r2.checksum,
+           r1.checksum == r2.checksum ? "(match)" : "(MISMATCH)");
+    printf("server %.1f ns/msg, total %.1f ns/msg\n",
+           (double)r1.server_ns / r1.frames, (double)r1.total_ns / r1.frames);
+    return (r1.checksum == r2.checksum && r1.errors + r2.errors == 0) ? 0 : -1;
+}
+
+/*-------------------------- prof：分段计时的开销 --------------------------*/
+
+#define PROF_ROUNDS     31
+#define PROF_COST_LOOPS 1000000
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+//一条完整trace的成本：prof_wake + prof_begin选中 + 两次prof_set + 6次打点 + prof_end入直方图
+static double prof_trace_ns(void) {
+    static struct prof p;
+    int i = 0, j = 0;
+
+    prof_init(&p, 1);
+    uint64_t t0 = now_ns();
+    for (i = 0; i < PROF_COST_LOOPS; ++i) {
+        uint64_t wake = prof_wake(&p, 1);
+        struct prof_trace *tr = prof_begin(&p, i);
+        prof_set(tr, PP_WAKE, wake);
+        prof_set(tr, PP_ARRIVE, wake);
+        for (j = PP_READ; j < PP_MAX; ++j) {
+            prof_mark(tr, j);
+        }
+        prof_end(&p, tr);
+    }
+    return (double)(now_ns() - t0) / PROF_COST_LOOPS;
+}
+
+static int prof_test(uint32_t every) {
+    static struct prof prof;
+    double off[PROF_ROUNDS], on[PROF_ROUNDS], diff[PROF_ROUNDS];
+    unsigned long frames = 0;
+    int i = 0;
+
+    //交替跑，每轮换一次先后顺序；只用中位数，并给出关闭采样时自己的四分位距作为抖动的参照
+    for (i = 0; i < PROF_ROUNDS; ++i) {
+        struct det_result r_off, r_on;
+        int ok = (i & 1) ? (det_run(1, every, &prof, &r_on) == 0 && det_run(1, 0, NULL, &r_off) == 0)
+                         : (det_run(1, 0, NULL, &r_off) == 0 && det_run(1, every, &prof, &r_on) == 0);
+        if (!ok) {
+            printf("det run failed\n");
+            return -1;
+        }
+        off[i] = (double)r_off.server_ns / r_off.frames;
+        on[i] = (double)r_on.server_ns / r_on.frames;
+        diff[i] = (on[i] - off[i]) * 100.0 / off[i];
+        frames = r_on.frames;
+    }
+    qsort(off, PROF_ROUNDS, sizeof(double), cmp_double);
+    qsort(on, PROF_ROUNDS, sizeof(double), cmp_double);
+    qsort(diff, PROF_ROUNDS, sizeof(double), cmp_double);
+
+    double med_off = off[PROF_ROUNDS / 2];
+    double med_on = on[PROF_ROUNDS / 2];
+    printf("%d rounds, server ns/msg median: off %.1f, 1/%u sampled %.1f\n", PROF_ROUNDS, med_off, every, med_on);
+    printf("paired overhead: median %+.2f%%, quartiles %+.2f%% .. %+.2f%%, off-run IQR %.2f%% of median\n",
+           diff[PROF_ROUNDS / 2], diff[PROF_ROUNDS / 4], diff[PROF_ROUNDS * 3 / 4],
+           (off[PROF_ROUNDS * 3 / 4] - off[PROF_ROUNDS / 4]) * 100.0 / med_off);
+
+    //A/B对比分辨不了比抖动还小的差别，再按单条trace的成本直接估一次（未选中事件只有一次递减，忽略）
+    double trace_ns = prof_trace_ns();
+    unsigned long picked = prof.samples + prof.dropped;
+    printf("direct estimate: %.1f ns/trace x %lu traces / %lu msgs = %.2f ns/msg (%.2f%%)\n",
+           trace_ns, picked, frames, trace_ns * picked / frames, trace_ns * picked / frames * 100.0 / med_off);
+    prof_dump(&prof, stdout, 10);
+    return 0;
+}
+
+/*-------------------------- bench：客户端/服务器各一个线程 --------------------------*/
+
+#define BENCH_REQUESTS  20000
+#define BENCH_WINDOW    16
+#define BENCH_PAYLOAD   64
+
+struct bench {
+    struct server s;
+    struct eventpoll *cep;
+    struct client *cls;
+    int nclients;
+    atomic_int stop;
+};
+
+static void *server_thread(void *arg) {
+    struct bench *b = (struct bench*)arg;
+    while (!atomic_load(&b->stop) || b->s.nconn > 0) {
+        server_poll(&b->s, 10);
+    }
+    return NULL;
+}
+
+static void bench_run(int nclients) {
+    struct bench *b = (struct bench*)calloc(1, sizeof(struct bench));
+    if (!b || server_init(&b->s, PROF_EVERY) < 0) {
+        return;
+    }
+    b->cep = ep_create();
+    b->cls = (struct client*)calloc(nclients, sizeof(struct client));
+    b->nclients = nclients;
+    if (!b->cep || !b->cls || connect_clients(&b->s, b->cep, b->cls, nclients) < 0) {
+        printf("setup failed\n");
+        return;
+    }
+
+    int i = 0;
+    for (i = 0; i < nclients; ++i) {
+        b->cls[i].rng = i + 1;
+        b->cls[i].total = BENCH_REQUESTS;
+        b->cls[i].window = BENCH_WINDOW;
+    }
+
+    pthread_t tid;
+    uint64_t start = now_ns();
+    pthread_create(&tid, NULL, server_thread, b);
+
+    for (i = 0; i < nclients; ++i) {
+        client_fill(&b->cls[i], BENCH_PAYLOAD, BENCH_PAYLOAD);
+    }
+    int done = 0;
+    while (done < nclients) {
+        struct epoll_event events[MAX_EVENTS];
+        int nready = ep_wait(b->cep, events, MAX_EVENTS, 10);
+        int j = 0;
+        for (j = 0; j < nready; ++j) {
+            struct client *cl = &b->cls[events[j].data.fd / 2];
+            if (cl->seq_recv == cl->total) continue;
+            client_read(cl);
+            client_fill(cl, BENCH_PAYLOAD, BENCH_PAYLOAD);
+            if (cl->seq_recv == cl->total) done++;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    unsigned long errors = 0;
+    for (i = 0; i < nclients; ++i) {
+        errors += b->cls[i].errors;
+        ep_ctl(b->cep, EPOLL_CTL_DEL, b->cls[i].fd, NULL);
+        lb_close(b->cls[i].fd);
+    }
+    atomic_store(&b->stop, 1);
+    pthread_join(tid, NULL);
+
+    unsigned long msgs = (unsigned long)nclients * BENCH_REQUESTS;
+    printf("%7d %12.0f %10.1f %8lu\n", nclients, msgs * 1e9 / elapsed, (double)elapsed / msgs, errors);
+
+    server_destroy(&b->s);
+    ep_destroy(b->cep);
+    free(b->cls);
+    free(b);
+    lb_cleanup();
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 2 && !strcmp(argv[1], "det")) {
+        uint32_t seed = argc >= 3 ? (uint32_t)strtoul(argv[2], NULL, 10) : 1;
+        return det_test(seed) < 0 ? -1 : 0;
+    }
+
+    if (argc >= 2 && !strcmp(argv[1], "prof")) {
+        uint32_t every = argc >= 3 ? (uint32_t)strtoul(argv[2], NULL, 10) : PROF_EVERY;
+        return prof_test(every ? every : 1) < 0 ? -1 : 0;
+    }
+
+    if (argc >= 2 && !strcmp(argv[1], "bench")) {
+        int n = argc >= 3 ? atoi(argv[2]) : 0;
+        signal(SIGUSR1, on_sigusr1);
+        printf("payload %d bytes, window %d, %d requests/conn\n", BENCH_PAYLOAD, BENCH_WINDOW, BENCH_REQUESTS);
+        printf("%7s %12s %10s %8s\n", "conns", "msgs/s", "ns/msg", "errors");
+        if (n > 0) {
+            bench_run(n);
+        } else {
+            for (n = 1; n <= 256; n *= 4) {
+                bench_run(n);
+            }
+        }
+        return 0;
+    }
+
+    printf("usage: %s det [seed] | bench [conns] | prof [every]\n", argv[0]);
+    return -1;
+}
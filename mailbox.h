@@ -0,0 +1,194 @@
+//reactor跨线程投递：eventfd + MPSC无锁队列
+
+/*
+    epoll.c的事件循环只会被socket就绪唤醒，其他线程（游戏逻辑、DB回调）想给某个连接发数据，
+    直接调用send()是不安全的：连接的fd和输出缓冲都归reactor线程所有。
+    做法是每个reactor持有一个mailbox：
+        1.一个eventfd，和socket一样注册到reactor的epoll红黑树里；
+        2.一条MPSC（多生产者单消费者）无锁队列，任意线程push，只有reactor线程pop。
+
+    队列使用侵入式的Vyukov MPSC队列：
+        push只有一次原子交换(xchg head)加一次普通写(prev->next)，生产者之间不需要锁；
+        pop只由reactor线程执行，不需要原子RMW。
+    xchg和prev->next之间有一个极短的窗口，此时队列是“不一致”的，pop会返回NULL，
+    这个任务由下面的唤醒合并机制保证不会丢。
+
+    唤醒合并：
+        如果每投递一个任务就write(eventfd)一次，高频投递时系统调用的开销比任务本身还大。
+        mailbox里有一个pending标志：
+        生产者：先push任务，再atomic_exchange(pending, 1)，只有拿到旧值0的那个生产者才write(eventfd)；
+        消费者：read(eventfd)，atomic_exchange(pending, 0)，然后把队列取空。
+        于是一批任务（在reactor取空队列之前投递的所有任务）只触发一次eventfd写。
+        消费者清pending用的也是RMW，它和生产者的xchg构成release/acquire，
+        所以凡是“看到pending已经是1”而没有写eventfd的生产者，它push的节点一定对随后的pop可见。
+
+    用法：
+        struct mailbox mb;
+        mailbox_init(&mb);
+        ev.events = EPOLLIN;
+        ev.data.fd = mb.efd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, mb.efd, &ev);
+
+        //其他线程
+        mailbox_post(&mb, &task->node);
+
+        //reactor线程
+        if (events[i].data.fd == mb.efd) {
+            mailbox_drain(&mb, 1024);
+        }
+*/
+
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+struct mb_task {
+    struct mb_task *_Atomic next;
+    //在reactor线程中执行，任务内存由投递方管理（通常在fn里free或者归还对象池）
+    void (*fn)(struct mb_task *task);
+};
+
+struct mailbox {
+    //生产者只碰head和pending，消费者只碰tail，分开放在不同cache line，避免伪共享。
+    //_Alignas让整个结构体也按64对齐，堆上分配时要用aligned_alloc
+    _Alignas(64) struct mb_task *_Atomic head;
+    atomic_int pending;
+
+    _Alignas(64) struct mb_task *tail;
+    struct mb_task stub;
+    int efd;
+
+    atomic_ulong wakeups; //eventfd写入次数，用来观察合并效果
+    unsigned long executed;
+};
+
+static inline int mailbox_init(struct mailbox *mb) {
+    atomic_store_explicit(&mb->stub.next, NULL, memory_order_relaxed);
+    mb->stub.fn = NULL;
+    atomic_store_explicit(&mb->head, &mb->stub, memory_order_relaxed);
+    mb->tail = &mb->stub;
+    atomic_store(&mb->pending, 0);
+    atomic_store(&mb->wakeups, 0);
+    mb->executed = 0;
+
+    mb->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mb->efd < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static inline void mailbox_destroy(struct mailbox *mb) {
+    if (mb->efd >= 0) {
+        close(mb->efd);
+        mb->efd = -1;
+    }
+}
+
+static inline void mb_push(struct mailbox *mb, struct mb_task *task) {
+    atomic_store_explicit(&task->next, NULL, memory_order_relaxed);
+    struct mb_task *prev = atomic_exchange_explicit(&mb->head, task, memory_order_acq_rel);
+    //此刻到下一行之间，消费者看到的链表是断开的
+    atomic_store_explicit(&prev->next, task, memory_order_release);
+}
+
+//仅reactor线程调用
+static inline struct mb_task *mb_pop(struct mailbox *mb) {
+    struct mb_task *tail = mb->tail;
+    struct mb_task *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &mb->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        mb->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+
+    if (next) {
+        mb->tail = next;
+        return tail;
+    }
+
+    struct mb_task *head = atomic_load_explicit(&mb->head, memory_order_acquire);
+    if (tail != head) {
+        //有生产者正处在xchg和链接之间
+        return NULL;
+    }
+
+    mb_push(mb, &mb->stub);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        mb->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static inline void mb_wake(struct mailbox *mb) {
+    if (atomic_exchange_explicit(&mb->pending, 1, memory_order_acq_rel) == 0) {
+        uint64_t one = 1;
+        //eventfd计数器溢出才会失败(EAGAIN)，此时reactor必然还有未读的唤醒，可以忽略
+        ssize_t ret = write(mb->efd, &one, sizeof(one));
+        (void)ret;
+        atomic_fetch_add_explicit(&mb->wakeups, 1, memory_order_relaxed);
+    }
+}
+
+//任意线程调用
+static inline void mailbox_post(struct mailbox *mb, struct mb_task *task) {
+    mb_push(mb, task);
+    mb_wake(mb);
+}
+
+//一次投递多个任务，只做一次唤醒判断
+static inline void mailbox_post_batch(struct mailbox *mb, struct mb_task **tasks, int n) {
+    int i = 0;
+    for (i = 0; i < n; ++i) {
+        mb_push(mb, tasks[i]);
+    }
+    if (n > 0) {
+        mb_wake(mb);
+    }
+}
+
+/*
+    仅reactor线程调用，eventfd可读时执行。
+    max限制单次执行的任务数，避免逻辑线程疯狂投递时把socket IO饿死；
+    没取完的情况下自己补一次唤醒，下一轮epoll_wait会立即返回。
+    返回执行的任务数。
+*/
+static inline int mailbox_drain(struct mailbox *mb, int max) {
+    uint64_t cnt;
+    ssize_t ret = read(mb->efd, &cnt, sizeof(cnt));
+    (void)ret;
+
+    atomic_exchange_explicit(&mb->pending, 0, memory_order_acq_rel);
+
+    int n = 0;
+    while (n < max) {
+        struct mb_task *task = mb_pop(mb);
+        if (task == NULL) {
+            break;
+        }
+        task->fn(task);
+        ++n;
+    }
+
+    //pop因为队列不一致提前返回时不需要处理：那个生产者的xchg(pending)发生在我们清pending之后，
+    //它（或者比它更早置位的生产者）一定会再写一次eventfd
+    if (n == max) {
+        mb_wake(mb);
+    }
+
+    mb->executed += n;
+    return n;
+}
+
+#endif
@@ -0,0 +1,281 @@
+//热路径分段计时：每条消息在reactor里各阶段的耗时直方图 + 最慢消息的明细
+
+/*
+    线上p99抖动时，只有一个总延迟看不出时间花在哪：就绪之后等epoll_wait、排在同一批的其他fd后面、
+    读数据、解帧、分发、业务处理、等同一次读到的其他消息处理完、还是发送。
+    这里给一条消息经过reactor的路径打9个时间点：
+        PP_ARRIVE    fd变成就绪（数据到达，协议栈把它挂进rdlist），由使用者从协议栈取到后用prof_set填
+        PP_WAKE      epoll_wait返回，每轮循环由prof_wake取一次，选中后用prof_set填
+        PP_READY     reactor开始处理这个fd
+        PP_READ      recv读到了包含这条消息的数据
+        PP_DECODE    帧头解析完，知道了msgid和长度
+        PP_DISPATCH  查到handler，开始执行
+        PP_ENQUEUE   handler把回包放进输出队列
+        PP_FLUSH     开始flush输出队列（同一次读到的后面的消息都已经处理完）
+        PP_WRITE     这条回包的最后一个字节交给了send
+    相邻两点之差就是一个阶段：
+        wait      就绪 -> epoll_wait返回
+        queue     epoll_wait返回 -> 开始处理这个fd（排在同一批前面的fd之后）
+        read、decode、dispatch、handler
+        batch     回包入队 -> flush，也就是同一次读到的后面那些消息的处理时间
+        write     flush开始 -> 这条回包写完
+    再加一个arrive->write的total。
+
+    开销控制：
+        1.时钟用rdtsc（x86上二三十个周期，不进内核），其他平台退回clock_gettime(CLOCK_MONOTONIC)（vDSO，也不进内核）；
+          tick到ns的换算只在输出时做，prof_init里用clock_gettime标定一次。
+          PP_ARRIVE一般在别的线程（协议栈一侧）取，依赖各核的TSC同步（invariant TSC，现代x86都满足）。
+        2.1/N采样：每个就绪事件只做一次计数器递减，没选中的事件trace指针是NULL，
+          后面每个打点都是一次指针判断；选中的事件只跟踪它的第一条消息。
+          N=64时平均每条消息不到一次rdtsc。具体开销和机器有关，loopback.c的prof模式会分别给出
+          直接估算（单条trace的成本 x 采样数）和开/关交替跑的中位数对比，后者要和同一组数据的抖动一起看。
+        3.编译时加-DPROF_DISABLE，PROF_ENABLED是常量0，prof_begin/prof_mark/prof_end都先判断它，
+          整个函数体连同对trace指针的读取都被编译器删掉；every为0或者PROF_DISABLE时prof_init也不做时钟标定。
+          使用者自己直接读写trace的代码也要以PROF_ENABLED开头，否则trace指针的读取和判断还会留下来。
+
+    直方图：log-linear分桶，每个2的幂区间再分4个子桶，误差不超过25%，256个桶覆盖整个uint64范围，
+        记录只是一次clz和一次自增，百分位在输出时从桶里数出来（取桶的上界）。
+
+    最近的PROF_RECENT条完整trace保存在环里，prof_dump时按total排序输出最慢的几条的各阶段明细。
+    触发方式由使用者决定，一般是SIGUSR1的handler里置一个标志，reactor循环里看到标志再调用prof_dump，
+    这样所有数据都只被reactor线程自己访问，不需要锁（多reactor时每个线程一个struct prof）。
+*/
+
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifdef PROF_DISABLE
+#define PROF_ENABLED    0
+#else
+#define PROF_ENABLED    1
+#endif
+
+enum prof_point {
+    PP_ARRIVE,
+    PP_WAKE,
+    PP_READY,
+    PP_READ,
+    PP_DECODE,
+    PP_DISPATCH,
+    PP_ENQUEUE,
+    PP_FLUSH,
+    PP_WRITE,
+    PP_MAX
+};
+
+#define PROF_STAGES     PP_MAX  //8个阶段 + total
+#define PROF_BUCKETS    256
+#define PROF_RECENT     1024
+
+static const char *prof_stage_name[PROF_STAGES] = {
+    "wait", "queue", "read", "decode", "dispatch", "handler", "batch", "write", "total"
+};
+
+struct prof_trace {
+    uint64_t t[PP_MAX];
+    int fd;
+    uint16_t msgid;
+};
+
+struct prof {
+    uint32_t every;     //1/N采样，0表示关闭
+    uint32_t countdown;
+    double ns_per_tick;
+
+    struct prof_trace cur;
+    uint64_t hist[PROF_STAGES][PROF_BUCKETS];
+    unsigned long samples;
+    unsigned long dropped;  //选中了但没跟踪到完整消息（比如只读到半帧）
+
+    struct prof_trace recent[PROF_RECENT];
+    unsigned long nrecent;
+};
+
+static inline uint64_t prof_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static inline int prof_bucket(uint64_t v) {
+    if (v < 4) {
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    return msb * 4 + (int)((v >> (msb - 2)) & 3);
+}
+
+//桶的上界，和prof_bucket对应
+static inline uint64_t prof_bucket_upper(int b) {
+    if (b < 4) {
+        return (uint64_t)b;
+    }
+    int msb = b / 4;
+    uint64_t base = 1ull << msb;
+    uint64_t step = base >> 2;
+    return base + step * ((b & 3) + 1) - 1;
+}
+
+static inline void prof_init(struct prof *p, uint32_t every) {
+    memset(p, 0, sizeof(*p));
+    p->every = every;
+    p->countdown = every;
+#ifdef PROF_DISABLE
+    p->every = 0;
+#endif
+    //不采样就不会有数据要换算，省掉10ms的标定
+    if (p->every == 0) {
+        return;
+    }
+
+    struct timespec a, b;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    uint64_t t0 = prof_now();
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &b);
+    } while ((b.tv_sec - a.tv_sec) * 1000000000ll + (b.tv_nsec - a.tv_nsec) < 10000000);
+    uint64_t t1 = prof_now();
+    p->ns_per_tick = (double)((b.tv_sec - a.tv_sec) * 1000000000ll + (b.tv_nsec - a.tv_nsec)) / (double)(t1 - t0);
+}
+
+//epoll_wait返回后调用一次；这一批nready个事件里不会有被选中的就不取时间，返回0
+static inline uint64_t prof_wake(struct prof *p, int nready) {
+    if (!PROF_ENABLED || p->every == 0 || nready <= 0 || p->countdown > (uint32_t)nready) {
+        return 0;
+    }
+    return prof_now();
+}
+
+//每个就绪事件调用一次，选中时返回trace并记下PP_READY
+static inline struct prof_trace *prof_begin(struct prof *p, int fd) {
+#ifdef PROF_DISABLE
+    (void)p;
+    (void)fd;
+    return NULL;
+#else
+    if (p->every == 0 || --p->countdown != 0) {
+        return NULL;
+    }
+    p->countdown = p->every;
+    memset(&p->cur, 0, sizeof(p->cur));
+    p->cur.fd = fd;
+    p->cur.t[PP_READY] = prof_now();
+    return &p->cur;
+#endif
+}
+
+//同一个点只记第一次，所以一个事件里后面的消息不会覆盖第一条消息的时间
+static inline void prof_mark(struct prof_trace *tr, int point) {
+    if (PROF_ENABLED && tr && !tr->t[point]) {
+        tr->t[point] = prof_now();
+    }
+}
+
+//填一个在别处取到的时间点（PP_ARRIVE、PP_WAKE）
+static inline void prof_set(struct prof_trace *tr, int point, uint64_t t) {
+    if (PROF_ENABLED && tr) {
+        tr->t[point] = t;
+    }
+}
+
+//事件处理完调用，完整的trace计入直方图和最近记录，不完整的丢弃
+static inline void prof_end(struct prof *p, struct prof_trace *tr) {
+    if (!PROF_ENABLED || !tr) {
+        return;
+    }
+    int i = 0;
+    for (i = 0; i < PP_MAX; ++i) {
+        if (!tr->t[i]) {
+            p->dropped++;
+            return;
+        }
+    }
+    for (i = 0; i < PP_MAX - 1; ++i) {
+        p->hist[i][prof_bucket(tr->t[i + 1] - tr->t[i])]++;
+    }
+    p->hist[PROF_STAGES - 1][prof_bucket(tr->t[PP_WRITE] - tr->t[PP_ARRIVE])]++;
+    p->samples++;
+    p->recent[p->nrecent++ % PROF_RECENT] = *tr;
+}
+
+static inline uint64_t prof_percentile(const uint64_t *hist, uint64_t total, double pct) {
+    uint64_t want = (uint64_t)(total * pct);
+    uint64_t seen = 0;
+    int b = 0;
+    for (b = 0; b < PROF_BUCKETS; ++b) {
+        seen += hist[b];
+        if (seen > want) {
+            return prof_bucket_upper(b);
+        }
+    }
+    return 0;
+}
+
+static inline int prof_cmp_total(const void *a, const void *b) {
+    const struct prof_trace *x = (const struct prof_trace*)a;
+    const struct prof_trace *y = (const struct prof_trace*)b;
+    uint64_t tx = x->t[PP_WRITE] - x->t[PP_ARRIVE];
+    uint64_t ty = y->t[PP_WRITE] - y->t[PP_ARRIVE];
+    return tx < ty ? 1 : (tx > ty ? -1 : 0);
+}
+
+//输出各阶段的p50/p99/max和最近最慢的top条trace
+static inline void prof_dump(struct prof *p, FILE *out, int top) {
+    int i = 0, b = 0;
+    double k = p->ns_per_tick;
+
+    fprintf(out, "prof: 1/%u sampled, %lu traces, %lu dropped\n", p->every, p->samples, p->dropped);
+    fprintf(out, "%10s %10s %10s %10s\n", "stage(ns)", "p50", "p99", "max");
+    for (i = 0; i < PROF_STAGES; ++i) {
+        uint64_t max = 0;
+        for (b = 0; b < PROF_BUCKETS; ++b) {
+            if (p->hist[i][b]) max = prof_bucket_upper(b);
+        }
+        fprintf(out, "%10s %10.0f %10.0f %10.0f\n", prof_stage_name[i],
+                prof_percentile(p->hist[i], p->samples, 0.50) * k,
+                prof_percentile(p->hist[i], p->samples, 0.99) * k, max * k);
+    }
+
+    int n = p->nrecent < PROF_RECENT ? (int)p->nrecent : PROF_RECENT;
+    if (n == 0 || top <= 0) {
+        return;
+    }
+    struct prof_trace *sorted = (struct prof_trace*)malloc(n * sizeof(struct prof_trace));
+    if (!sorted) {
+        return;
+    }
+    memcpy(sorted, p->recent, n * sizeof(struct prof_trace));
+    qsort(sorted, n, sizeof(struct prof_trace), prof_cmp_total);
+
+    fprintf(out, "slowest %d of last %d:\n", top < n ? top : n, n);
+    fprintf(out, "%6s %6s", "fd", "msgid");
+    for (i = 0; i < PROF_STAGES; ++i) {
+        fprintf(out, " %9s", prof_stage_name[i]);
+    }
+    fprintf(out, "\n");
+    for (i = 0; i < top && i < n; ++i) {
+        struct prof_trace *tr = &sorted[i];
+        fprintf(out, "%6d %6u", tr->fd, tr->msgid);
+        for (b = 0; b < PP_MAX - 1; ++b) {
+            fprintf(out, " %9.0f", (tr->t[b + 1] - tr->t[b]) * k);
+        }
+        fprintf(out, " %9.0f\n", (tr->t[PP_WRITE] - tr->t[PP_ARRIVE]) * k);
+    }
+    free(sorted);
+}
+
+#endif
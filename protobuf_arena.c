@@ -0,0 +1,613 @@
+//服务器侧protobuf解码：per-reactor arena + 按msgid复用消息对象 + string/bytes惰性视图
+
+/*
+    protobuf.c记录的是客户端的封包，服务器收到帧之后要把body解成消息。
+    如果每个body都new一个消息对象、每个string字段都malloc一份拷贝，
+    在每秒几十万帧的量级下，分配器（以及它的锁、cache miss）会成为主要开销。
+
+    这里的做法：
+    1.消息对象按msgid复用
+        每个reactor有一张msgid -> 消息对象的表，对象在启动时分配一次。
+        收到一帧：查表，clear，parse，调handler。handler返回后对象就可以被下一帧复用，
+        handler如果要把数据留到之后用，必须自己拷贝（和reactor里复用recv缓冲区是一样的约定）。
+
+    2.string/bytes字段是接收缓冲区里的视图
+        解析时不拷贝，只记录(ptr, len)，指向recv缓冲区里的原始字节。
+        真正需要一个以'\0'结尾的C字符串时才调用pb_str_cstr()，从arena里拷一份。
+        也就是“惰性解析”：大部分handler只比较、转发或者根本不看这些字段，就完全没有拷贝。
+        视图的生命周期和recv缓冲区一样：到本轮循环结束。
+
+    3.per-reactor arena
+        解析中确实需要的内存（repeated字段的数组、pb_str_cstr的拷贝）都从arena里按指针递增分配，不单独free。
+        每轮epoll_wait处理完所有就绪事件后arena_reset()，把偏移量归零，内存整块复用。
+        arena只在某一轮需要的量超过已有块时才malloc新块，稳态下每帧0次malloc。
+        arena属于reactor线程，不需要任何锁。
+
+    Msgtest定义（字段1-5与protobuf.c的客户端一致）：
+        message Msgtest {
+            string name = 1;
+            int32  age = 2;
+            string email = 3;
+            bool   online = 4;
+            double account = 5;
+            repeated string tags = 6;   //客户端没有这个字段，是这里加的扩展，用来覆盖repeated字段的解析
+        }
+    benchmark分两组数据跑：只带字段1-5的帧（和客户端发的一样），以及每帧再带两个tags的扩展帧。
+    对照组每帧的malloc次数：前者是3次（消息对象、name、email），后者多了tags数组和两个元素，是6次。
+
+    wire type：
+        0 varint: int32/int64/uint32/uint64/bool/enum
+        1 64-bit: fixed64/double
+        2 length-delimited: string/bytes/嵌套message/packed repeated
+        5 32-bit: fixed32/float
+    每个字段以tag = (field_number << 3) | wire_type的varint开头。
+
+    编译运行：
+        gcc -O2 -o protobuf_arena protobuf_arena.c
+        ./protobuf_arena [帧数]
+        分别对客户端的Msgtest和带tags的扩展帧，对比“每帧malloc消息对象+拷贝字符串”和
+        “arena+对象复用+视图”两种方式的分配次数和吞吐。
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define ARENA_BLOCK   (64 * 1024)
+#define MAX_MSGID     1024
+#define BATCH_FRAMES  64  //模拟每轮epoll_wait处理的帧数
+
+static unsigned long g_mallocs;
+
+static void *count_malloc(size_t size) {
+    ++g_mallocs;
+    return malloc(size);
+}
+
+/*-------------------------- arena --------------------------*/
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct arena {
+    struct arena_block *head; //当前分配的块
+    struct arena_block *free; //reset后留下来待复用的块
+};
+
+static void *arena_alloc(struct arena *a, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+
+    struct arena_block *b = a->head;
+    if (b && b->used + size <= b->size) {
+        void *p = b->data + b->used;
+        b->used += size;
+        return p;
+    }
+
+    //先从reset下来的块里拿，不够大才malloc
+    struct arena_block **pp = &a->free;
+    while (*pp && (*pp)->size < size) {
+        pp = &(*pp)->next;
+    }
+    if (*pp) {
+        b = *pp;
+        *pp = b->next;
+    } else {
+        size_t bsize = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        b = (struct arena_block*)count_malloc(sizeof(struct arena_block) + bsize);
+        if (!b) {
+            return NULL;
+        }
+        b->size = bsize;
+    }
+
+    b->used = size;
+    b->next = a->head;
+    a->head = b;
+    return b->data;
+}
+
+//每轮事件循环结束调用一次，所有块挂回free链表
+static void arena_reset(struct arena *a) {
+    while (a->head) {
+        struct arena_block *b = a->head;
+        a->head = b->next;
+        b->used = 0;
+        b->next = a->free;
+        a->free = b;
+    }
+}
+
+static void arena_destroy(struct arena *a) {
+    arena_reset(a);
+    while (a->free) {
+        struct arena_block *b = a->free;
+        a->free = b->next;
+        free(b);
+    }
+}
+
+/*-------------------------- wire format --------------------------*/
+
+struct pb_str {
+    const char *ptr; //指向recv缓冲区，不以'\0'结尾
+    uint32_t len;
+};
+
+static const char *pb_str_cstr(struct arena *a, struct pb_str s) {
+    char *p = (char*)arena_alloc(a, s.len + 1);
+    if (!p) {
+        return NULL;
+    }
+    memcpy(p, s.ptr, s.len);
+    p[s.len] = '\0';
+    return p;
+}
+
+struct pb_reader {
+    const unsigned char *p;
+    const unsigned char *end;
+};
+
+static inline int pb_varint(struct pb_reader *r, uint64_t *out) {
+    uint64_t v = 0;
+    int shift = 0;
+    while (r->p < r->end && shift < 64) {
+        unsigned char b = *r->p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *out = v;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+static inline int pb_bytes(struct pb_reader *r, struct pb_str *out) {
+    uint64_t len;
+    if (pb_varint(r, &len) < 0 || len > (uint64_t)(r->end - r->p)) {
+        return -1;
+    }
+    out->ptr = (const char*)r->p;
+    out->len = (uint32_t)len;
+    r->p += len;
+    return 0;
+}
+
+static inline int pb_fixed64(struct pb_reader *r, uint64_t *out) {
+    if (r->end - r->p < 8) {
+        return -1;
+    }
+    //wire format里的fixed64是小端
+    uint64_t v = 0;
+    int i = 0;
+    for (i = 7; i >= 0; --i) {
+        v = (v << 8) | r->p[i];
+    }
+    *out = v;
+    r->p += 8;
+    return 0;
+}
+
+static int pb_skip(struct pb_reader *r, int wire_type) {
+    uint64_t v;
+    struct pb_str s;
+    switch (wire_type) {
+    case 0: return pb_varint(r, &v);
+    case 1: return pb_fixed64(r, &v);
+    case 2: return pb_bytes(r, &s);
+    case 5:
+        if (r->end - r->p < 4) return -1;
+        r->p += 4;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/*-------------------------- Msgtest --------------------------*/
+
+struct msgtest {
+    struct pb_str name;
+    int32_t age;
+    struct pb_str email;
+    int online;
+    double account;
+
+    struct pb_str *tags; //arena上的数组
+    uint32_t ntags;
+    uint32_t captags;
+};
+
+static void msgtest_clear(void *m) {
+    memset(m, 0, sizeof(struct msgtest));
+}
+
+static int msgtest_add_tag(struct msgtest *m, struct arena *a, struct pb_str s) {
+    if (m->ntags == m->captags) {
+        uint32_t cap = m->captags ? m->captags * 2 : 4;
+        struct pb_str *tags = (struct pb_str*)arena_alloc(a, cap * sizeof(struct pb_str));
+        if (!tags) {
+            return -1;
+        }
+        //旧数组留在arena里，本轮结束一起回收
+        if (m->ntags) {
+            memcpy(tags, m->tags, m->ntags * sizeof(struct pb_str));
+        }
+        m->tags = tags;
+        m->captags = cap;
+    }
+    m->tags[m->ntags++] = s;
+    return 0;
+}
+
+static int msgtest_parse(void *msg, struct arena *a, const unsigned char *data, int len) {
+    struct msgtest *m = (struct msgtest*)msg;
+    struct pb_reader r = { data, data + len };
+
+    while (r.p < r.end) {
+        uint64_t tag, v;
+        struct pb_str s;
+        if (pb_varint(&r, &tag) < 0) {
+            return -1;
+        }
+
+        switch (tag) {
+        case (1 << 3) | 2:
+            if (pb_bytes(&r, &m->name) < 0) return -1;
+            break;
+        case (2 << 3) | 0:
+            if (pb_varint(&r, &v) < 0) return -1;
+            m->age = (int32_t)v;
+            break;
+        case (3 << 3) | 2:
+            if (pb_bytes(&r, &m->email) < 0) return -1;
+            break;
+        case (4 << 3) | 0:
+            if (pb_varint(&r, &v) < 0) return -1;
+            m->online = v != 0;
+            break;
+        case (5 << 3) | 1:
+            if (pb_fixed64(&r, &v) < 0) return -1;
+            memcpy(&m->account, &v, sizeof(double));
+            break;
+        case (6 << 3) | 2:
+            if (pb_bytes(&r, &s) < 0 || msgtest_add_tag(m, a, s) < 0) return -1;
+            break;
+        default:
+            //未知字段跳过，保持前向兼容
+            if (pb_skip(&r, (int)(tag & 7)) < 0) return -1;
+            break;
+        }
+    }
+    return 0;
+}
+
+/*-------------------------- 分发 --------------------------*/
+
+typedef void (*msg_handler)(void *msg, struct arena *a);
+
+struct msg_slot {
+    void *msg;
+    void (*clear)(void *msg);
+    int (*parse)(void *msg, struct arena *a, const unsigned char *data, int len);
+    msg_handler handler;
+};
+
+struct decode_ctx {
+    struct arena arena;
+    struct msg_slot slots[MAX_MSGID];
+};
+
+static int decode_register(struct decode_ctx *ctx, unsigned short msgid, size_t size,
+    void (*clear)(void*), int (*parse)(void*, struct arena*, const unsigned char*, int),
+    msg_handler handler) {
+
+    if (msgid >= MAX_MSGID) {
+        return -1;
+    }
+    struct msg_slot *slot = &ctx->slots[msgid];
+    slot->msg = count_malloc(size);
+    if (!slot->msg) {
+        return -1;
+    }
+    slot->clear = clear;
+    slot->parse = parse;
+    slot->handler = handler;
+    return 0;
+}
+
+/*
+    body: 2字节msgid + 2字节datasize + data（同protobuf.c）
+    返回0成功，-1格式错误（调用方应当关闭连接），-2未注册的msgid（丢弃）
+*/
+static int decode_body(struct decode_ctx *ctx, const unsigned char *body, int bodysize) {
+    if (bodysize < 4) {
+        return -1;
+    }
+    unsigned short msgid = (body[0] << 8) | body[1];
+    unsigned short datasize = (body[2] << 8) | body[3];
+    if (datasize > bodysize - 4) {
+        return -1;
+    }
+    if (msgid >= MAX_MSGID || !ctx->slots[msgid].msg) {
+        return -2;
+    }
+
+    struct msg_slot *slot = &ctx->slots[msgid];
+    slot->clear(slot->msg);
+    if (slot->parse(slot->msg, &ctx->arena, body + 4, datasize) < 0) {
+        return -1;
+    }
+    slot->handler(slot->msg, &ctx->arena);
+    return 0;
+}
+
+/*-------------------------- 基准测试 --------------------------*/
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned char *put_varint(unsigned char *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+static unsigned char *put_string(unsigned char *p, int field, const char *s) {
+    size_t len = strlen(s);
+    p = put_varint(p, (field << 3) | 2);
+    p = put_varint(p, len);
+    memcpy(p, s, len);
+    return p + len;
+}
+
+//按protobuf.c的规则封一帧，返回帧长；with_tags为0时只有客户端的字段1-5
+static int encode_msgtest_frame(unsigned char *buf, int i, int with_tags) {
+    char name[32], email[48];
+    snprintf(name, sizeof(name), "xiaoming%d", i % 1000);
+    snprintf(email, sizeof(email), "xiaoming%d@163.com", i % 1000);
+
+    unsigned char *p = buf + 6;
+    p = put_string(p, 1, name);
+    p = put_varint(p, (2 << 3) | 0);
+    p = put_varint(p, 18 + i % 50);
+    p = put_string(p, 3, email);
+    p = put_varint(p, (4 << 3) | 0);
+    p = put_varint(p, i & 1);
+
+    double account = 888.88 + i;
+    uint64_t bits;
+    memcpy(&bits, &account, sizeof(bits));
+    p = put_varint(p, (5 << 3) | 1);
+    int k = 0;
+    for (k = 0; k < 8; ++k) {
+        *p++ = (unsigned char)(bits >> (8 * k));
+    }
+    if (with_tags) {
+        p = put_string(p, 6, "vip");
+        p = put_string(p, 6, "guild");
+    }
+
+    int len = (int)(p - (buf + 6));
+    int bodysize = len + 4;
+    int msgid = 1;
+    buf[0] = bodysize >> 8;
+    buf[1] = bodysize & 0xff;
+    buf[2] = msgid >> 8;
+    buf[3] = msgid & 0xff;
+    buf[4] = len >> 8;
+    buf[5] = len & 0xff;
+    return 2 + bodysize;
+}
+
+static unsigned long g_checksum;
+
+//典型的handler：读数值字段，比较一下名字，只有少数情况需要C字符串
+static void on_msgtest(void *msg, struct arena *a) {
+    struct msgtest *m = (struct msgtest*)msg;
+    g_checksum += m->age + m->online + m->ntags + m->name.len;
+    if (m->age == 18) {
+        const char *email = pb_str_cstr(a, m->email);
+        if (email) {
+            g_checksum += email[0];
+        }
+    }
+}
+
+/*
+    对照组：每帧malloc一个消息对象，string字段各自malloc拷贝，repeated字段malloc数组，handler后全部free。
+    这就是直接在服务器上new Msgtest + ParseFromArray（不开arena）时的分配模式。
+*/
+struct msgtest_heap {
+    char *name;
+    int32_t age;
+    char *email;
+    int online;
+    double account;
+    char **tags;
+    uint32_t ntags;
+};
+
+static char *heap_str(struct pb_str s) {
+    char *p = (char*)count_malloc(s.len + 1);
+    if (!p) {
+        return NULL;
+    }
+    memcpy(p, s.ptr, s.len);
+    p[s.len] = '\0';
+    return p;
+}
+
+static void msgtest_heap_free(struct msgtest_heap *m) {
+    uint32_t k = 0;
+    for (k = 0; k < m->ntags; ++k) free(m->tags[k]);
+    free(m->tags);
+    free(m->name);
+    free(m->email);
+    free(m);
+}
+
+//出错时已经分配的字段留在m里，由调用方统一msgtest_heap_free
+static int msgtest_heap_parse(struct msgtest_heap *m, const unsigned char *data, int len) {
+    uint32_t cap = 0;
+    struct pb_reader r = { data, data + len };
+    while (r.p < r.end) {
+        uint64_t tag, v;
+        struct pb_str s;
+        if (pb_varint(&r, &tag) < 0) return -1;
+        switch (tag) {
+        case (1 << 3) | 2:
+            if (pb_bytes(&r, &s) < 0) return -1;
+            free(m->name);
+            if (!(m->name = heap_str(s))) return -1;
+            break;
+        case (2 << 3) | 0: if (pb_varint(&r, &v) < 0) return -1; m->age = (int32_t)v; break;
+        case (3 << 3) | 2:
+            if (pb_bytes(&r, &s) < 0) return -1;
+            free(m->email);
+            if (!(m->email = heap_str(s))) return -1;
+            break;
+        case (4 << 3) | 0: if (pb_varint(&r, &v) < 0) return -1; m->online = v != 0; break;
+        case (5 << 3) | 1: if (pb_fixed64(&r, &v) < 0) return -1; memcpy(&m->account, &v, 8); break;
+        case (6 << 3) | 2:
+            if (pb_bytes(&r, &s) < 0) return -1;
+            if (m->ntags == cap) {
+                cap = cap ? cap * 2 : 4;
+                char **tags = (char**)count_malloc(cap * sizeof(char*));
+                if (!tags) return -1;
+                if (m->ntags) memcpy(tags, m->tags, m->ntags * sizeof(char*));
+                free(m->tags);
+                m->tags = tags;
+            }
+            if (!(m->tags[m->ntags] = heap_str(s))) return -1;
+            m->ntags++;
+            break;
+        default:
+            if (pb_skip(&r, (int)(tag & 7)) < 0) return -1;
+            break;
+        }
+    }
+    return 0;
+}
+
+static int decode_body_heap(const unsigned char *body, int bodysize) {
+    if (bodysize < 4) {
+        return -1;
+    }
+    unsigned short datasize = (body[2] << 8) | body[3];
+    if (datasize > bodysize - 4) {
+        return -1;
+    }
+
+    struct msgtest_heap *m = (struct msgtest_heap*)count_malloc(sizeof(struct msgtest_heap));
+    if (!m) {
+        return -1;
+    }
+    memset(m, 0, sizeof(*m));
+
+    int ret = msgtest_heap_parse(m, body + 4, datasize);
+    if (ret == 0) {
+        g_checksum += m->age + m->online + m->ntags + (m->name ? strlen(m->name) : 0);
+    }
+    msgtest_heap_free(m);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    int nframes = 2000000;
+    if (argc >= 2) {
+        nframes = atoi(argv[1]);
+    }
+    if (nframes <= 0) {
+        return -1;
+    }
+
+    //模拟recv缓冲区：一轮循环收到BATCH_FRAMES帧，预先编码好若干轮的数据
+    const int nbatches = 256;
+    unsigned char *buf = (unsigned char*)malloc((size_t)nbatches * BATCH_FRAMES * 128);
+    int *batch_end = (int*)malloc(sizeof(int) * nbatches);
+    if (!buf || !batch_end) {
+        free(batch_end);
+        free(buf);
+        return -1;
+    }
+
+    printf("%-22s %-22s %12s %12s %12s\n", "frames", "mode", "frames/s", "MB/s", "malloc/frame");
+
+    int with_tags = 0;
+    for (with_tags = 0; with_tags < 2; ++with_tags) {
+        size_t buflen = 0;
+        int b = 0, i = 0;
+        for (b = 0; b < nbatches; ++b) {
+            for (i = 0; i < BATCH_FRAMES; ++i) {
+                buflen += encode_msgtest_frame(buf + buflen, b * BATCH_FRAMES + i, with_tags);
+            }
+            batch_end[b] = (int)buflen;
+        }
+
+        int mode = 0;
+        for (mode = 0; mode < 2; ++mode) {
+            struct decode_ctx *ctx = (struct decode_ctx*)calloc(1, sizeof(struct decode_ctx));
+            if (mode == 1) {
+                decode_register(ctx, 1, sizeof(struct msgtest), msgtest_clear, msgtest_parse, on_msgtest);
+            }
+
+            g_mallocs = 0;
+            uint64_t bytes = 0;
+            int done = 0;
+            uint64_t start = now_ns();
+
+            while (done < nframes) {
+                //一轮事件循环
+                int bi = (done / BATCH_FRAMES) % nbatches;
+                int off = bi ? batch_end[bi - 1] : 0;
+                int end = batch_end[bi];
+
+                while (off < end && done < nframes) {
+                    int bodysize = (buf[off] << 8) | buf[off + 1];
+                    if (mode == 0) {
+                        decode_body_heap(buf + off + 2, bodysize);
+                    } else {
+                        decode_body(ctx, buf + off + 2, bodysize);
+                    }
+                    off += 2 + bodysize;
+                    bytes += 2 + bodysize;
+                    ++done;
+                }
+
+                arena_reset(&ctx->arena);
+            }
+
+            uint64_t elapsed = now_ns() - start;
+            printf("%-22s %-22s %12.0f %12.1f %12.3f\n",
+                with_tags ? "Msgtest + tags (ext)" : "Msgtest (client)",
+                mode == 0 ? "heap per frame" : "arena + reuse + view",
+                done * 1e9 / elapsed,
+                bytes * 1e3 / elapsed,
+                (double)g_mallocs / done);
+
+            free(ctx->slots[1].msg);
+            arena_destroy(&ctx->arena);
+            free(ctx);
+        }
+    }
+
+    printf("checksum %lu\n", g_checksum);
+    free(batch_end);
+    free(buf);
+    return 0;
+}
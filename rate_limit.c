@@ -0,0 +1,574 @@
+//令牌桶限流：accept层按源IP限流，帧解码层按连接限流
+
+/*
+    epoll.c对客户端来者不拒，读到什么处理什么，一个恶意客户端疯狂发帧就能吃满一个reactor线程。
+    这里在两层做令牌桶限流：
+
+    1.令牌桶
+        桶里最多burst个令牌，每秒补充rate个，消耗一次拿走cost个，不够就是超限。
+        不需要定时器去补令牌：每次消耗时按 (now - last) * rate 算出这段时间该补多少，惰性补充。
+        令牌用千分之一为单位的定点数保存，避免浮点，也让rate较小时(比如每秒5个)按毫秒补充不丢精度。
+        时间用毫秒，每轮epoll_wait返回后取一次CLOCK_MONOTONIC_COARSE，整轮共用，不为每个连接/每帧取时间。
+
+    2.accept层：按源IP
+        同一个IP在短时间内大量建连直接close，不给它分配连接对象，也不注册到epoll。
+        IP表是开放寻址哈希表（线性探测），每项12字节：ip、令牌、上次补充时间，100万个IP约24MB(容量2^21)。
+        不做删除，因此不需要墓碑：
+            查找最多探测MAX_PROBE个槽；
+            没找到时，在这MAX_PROBE个槽里选一个空槽，没有空槽就覆盖最久没见过的那个IP。
+        被覆盖的IP下次再来就是一个满桶，相当于“长期不活跃的IP忘掉它的历史”，对限流无害。
+        覆盖只替换不清空，探测链不会断，其他key仍然能在MAX_PROBE内找到。
+
+    3.帧解码层：按连接
+        帧格式同protobuf.c：2字节bodysize(大端) + body(2字节msgid, 2字节datasize, data)。
+        每解出一帧，同时消耗“帧/秒”桶1个令牌、“字节/秒”桶帧长个令牌。
+        超限后不是继续读然后丢弃（那样CPU照样被吃掉），而是：
+            epoll_ctl(EPOLL_CTL_MOD)把EPOLLIN兴趣去掉，连接挂到暂停列表，记录恢复时间；
+            数据留在内核的接收缓冲区，对端的TCP窗口收缩，自然被反压；
+            事件循环根据最早的恢复时间计算epoll_wait的timeout，到期后MOD回EPOLLIN。
+        客户端socket用的是ET模式，MOD重新加上EPOLLIN时内核会重新检查就绪状态，
+        接收缓冲区里还有数据就会立即再通知一次，所以暂停期间没读完的数据不会丢失通知。
+
+    编译运行：
+        gcc -O2 -o rate_limit rate_limit.c
+        ./rate_limit 8888          服务器
+        ./rate_limit bench [nips]  基准测试：每帧限流开销，IP表规模nips（默认100万）
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+
+//accept：每个IP每秒5个新连接，突发20个
+#define IP_RATE        5
+#define IP_BURST       20
+//帧层：每个连接每秒200帧、256KB，突发为1秒的量
+#define CONN_FRAME_RATE  200
+#define CONN_BYTE_RATE   (256 * 1024)
+
+#define MAX_PROBE      16
+#define MAX_CONN       65536
+#define RBUF_SIZE      (65535 + 2)
+
+static inline uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*-------------------------- 令牌桶 --------------------------*/
+
+struct tbucket {
+    uint64_t tokens; //千分之一令牌
+    uint64_t last;   //上次补充时间(ms)
+};
+
+static inline void tb_init(struct tbucket *tb, uint32_t burst, uint64_t now) {
+    tb->tokens = (uint64_t)burst * 1000;
+    tb->last = now;
+}
+
+/*
+    消耗cost个令牌。
+    成功返回0；不够返回还需等待的毫秒数（至少1），桶不变。
+    rate是每秒补充的令牌数，每毫秒恰好补充rate个千分之一令牌。
+*/
+static inline uint64_t tb_consume(struct tbucket *tb, uint32_t rate, uint32_t burst, uint32_t cost, uint64_t now) {
+    uint64_t cap = (uint64_t)burst * 1000;
+    if (now > tb->last) {
+        uint64_t t = tb->tokens + (now - tb->last) * rate;
+        tb->tokens = t > cap ? cap : t;
+        tb->last = now;
+    }
+
+    uint64_t need = (uint64_t)cost * 1000;
+    if (tb->tokens >= need) {
+        tb->tokens -= need;
+        return 0;
+    }
+    return (need - tb->tokens + rate - 1) / rate;
+}
+
+/*-------------------------- IP表 --------------------------*/
+
+struct ip_entry {
+    uint32_t ip;     //0表示空槽，0.0.0.0不会是合法的源地址
+    uint32_t tokens; //千分之一令牌，IP_BURST*1000放得下
+    uint32_t last;   //ms，取低32位，够用49天，回绕按无符号差值计算
+};
+
+struct ip_table {
+    struct ip_entry *slots;
+    uint32_t mask;
+    int shift;
+    unsigned long evictions;
+};
+
+static int ip_table_init(struct ip_table *t, uint32_t capacity) {
+    uint32_t cap = 1;
+    int bits = 0;
+    while (cap < capacity) {
+        cap <<= 1;
+        ++bits;
+    }
+    t->slots = (struct ip_entry*)calloc(cap, sizeof(struct ip_entry));
+    if (!t->slots) {
+        return -1;
+    }
+    t->mask = cap - 1;
+    t->shift = 32 - bits;
+    t->evictions = 0;
+    return 0;
+}
+
+static inline uint32_t ip_hash(const struct ip_table *t, uint32_t ip) {
+    //Fibonacci hashing，取高位，连续网段也能打散
+    return (uint32_t)(ip * 2654435769u) >> t->shift;
+}
+
+/*
+    检查ip是否允许建立一个新连接，允许返回0，超限返回-1。
+*/
+static int ip_table_allow(struct ip_table *t, uint32_t ip, uint64_t now64) {
+    uint32_t now = (uint32_t)now64;
+    uint32_t cap = IP_BURST * 1000;
+    uint32_t pos = ip_hash(t, ip);
+    struct ip_entry *victim = NULL;
+    uint32_t oldest = 0;
+    int i = 0;
+
+    for (i = 0; i < MAX_PROBE; ++i) {
+        struct ip_entry *e = &t->slots[(pos + i) & t->mask];
+
+        if (e->ip == ip) {
+            uint32_t elapsed = now - e->last;
+            //elapsed*IP_RATE最多补满，提前截断避免溢出
+            if (elapsed >= cap / IP_RATE) {
+                e->tokens = cap;
+            } else {
+                uint32_t tk = e->tokens + elapsed * IP_RATE;
+                e->tokens = tk > cap ? cap : tk;
+            }
+            e->last = now;
+
+            if (e->tokens >= 1000) {
+                e->tokens -= 1000;
+                return 0;
+            }
+            return -1;
+        }
+
+        if (e->ip == 0) {
+            //探测链到头，不会出现在更后面，空槽优先于覆盖
+            victim = e;
+            break;
+        }
+
+        if (!victim || now - e->last > oldest) {
+            victim = e;
+            oldest = now - e->last;
+        }
+    }
+
+    if (victim->ip != 0) {
+        t->evictions++;
+    }
+    victim->ip = ip;
+    victim->tokens = cap - 1000;
+    victim->last = now;
+    return 0;
+}
+
+/*-------------------------- 连接 --------------------------*/
+
+struct conn {
+    int fd;
+    int paused;
+    uint64_t resume_at;
+    struct conn *next_paused;
+
+    struct tbucket frames;
+    struct tbucket bytes;
+
+    int rlen;
+    unsigned char rbuf[RBUF_SIZE];
+};
+
+struct server {
+    int epfd;
+    int listenfd;
+    struct ip_table ips;
+    struct conn *conns[MAX_CONN];
+    struct conn *paused; //按恢复时间无序，暂停的连接不多，线性扫描即可
+    uint64_t now;
+};
+
+/*
+    帧层限流，一帧解出后调用，允许返回0，超限返回需要暂停的毫秒数。
+    两个桶都要检查：帧令牌扣了之后字节桶不够，要把帧令牌退回去，否则暂停期间还白白多扣一次。
+*/
+static uint64_t conn_limit_frame(struct conn *c, uint32_t framelen, uint64_t now) {
+    uint64_t wf = tb_consume(&c->frames, CONN_FRAME_RATE, CONN_FRAME_RATE, 1, now);
+    if (wf) {
+        return wf;
+    }
+    uint32_t cost = framelen > CONN_BYTE_RATE ? CONN_BYTE_RATE : framelen;
+    uint64_t wb = tb_consume(&c->bytes, CONN_BYTE_RATE, CONN_BYTE_RATE, cost, now);
+    if (wb) {
+        //退还帧令牌
+        c->frames.tokens += 1000;
+        return wb;
+    }
+    return 0;
+}
+
+static void conn_pause(struct server *s, struct conn *c, uint64_t wait) {
+    struct epoll_event ev;
+    ev.events = 0; //去掉EPOLLIN，仍保留在红黑树里，EPOLLERR/EPOLLHUP照样会报告
+    ev.data.fd = c->fd;
+    epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+
+    c->paused = 1;
+    c->resume_at = s->now + wait;
+    c->next_paused = s->paused;
+    s->paused = c;
+}
+
+static void conn_read(struct server *s, struct conn *c);
+
+static void conn_resume_due(struct server *s) {
+    struct conn *due = NULL;
+    struct conn **pp = &s->paused;
+
+    //先摘下到期的连接，conn_read里可能再次暂停（插回s->paused）或者关闭连接
+    while (*pp) {
+        struct conn *c = *pp;
+        if (c->resume_at <= s->now) {
+            *pp = c->next_paused;
+            c->paused = 0;
+            c->next_paused = due;
+            due = c;
+        } else {
+            pp = &c->next_paused;
+        }
+    }
+
+    while (due) {
+        struct conn *c = due;
+        due = c->next_paused;
+        c->next_paused = NULL;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = c->fd;
+        epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+
+        //rbuf里可能还压着完整的帧，而内核缓冲区已经空了，ET不会再通知，这里主动读一次
+        conn_read(s, c);
+    }
+}
+
+static int next_timeout(struct server *s) {
+    if (!s->paused) {
+        return -1;
+    }
+    uint64_t earliest = UINT64_MAX;
+    struct conn *c = s->paused;
+    for (; c; c = c->next_paused) {
+        if (c->resume_at < earliest) earliest = c->resume_at;
+    }
+    return earliest > s->now ? (int)(earliest - s->now) : 0;
+}
+
+static void conn_close(struct server *s, struct conn *c) {
+    if (c->paused) {
+        struct conn **pp = &s->paused;
+        while (*pp != c) pp = &(*pp)->next_paused;
+        *pp = c->next_paused;
+    }
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    s->conns[c->fd] = NULL;
+    free(c);
+}
+
+static void on_frame(struct conn *c, const unsigned char *body, int bodysize) {
+    if (bodysize < 4) {
+        return;
+    }
+    unsigned short msgid = (body[0] << 8) | body[1];
+    unsigned short datasize = (body[2] << 8) | body[3];
+    printf("fd %d msgid %d, %d Bytes\n", c->fd, msgid, datasize);
+}
+
+/*
+    从rbuf中解帧，返回0继续读，返回1表示连接已暂停，停止读。
+*/
+static int conn_decode(struct server *s, struct conn *c) {
+    int off = 0;
+    int ret = 0;
+
+    while (c->rlen - off >= 2) {
+        int bodysize = (c->rbuf[off] << 8) | c->rbuf[off + 1];
+        if (c->rlen - off < 2 + bodysize) {
+            break;
+        }
+
+        uint64_t wait = conn_limit_frame(c, 2 + bodysize, s->now);
+        if (wait) {
+            //这一帧留在缓冲区，恢复后重新检查
+            conn_pause(s, c, wait);
+            ret = 1;
+            break;
+        }
+
+        on_frame(c, c->rbuf + off + 2, bodysize);
+        off += 2 + bodysize;
+    }
+
+    if (off > 0) {
+        memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+        c->rlen -= off;
+    }
+    return ret;
+}
+
+static void conn_read(struct server *s, struct conn *c) {
+    //恢复时先处理缓冲区里留下的完整帧
+    if (conn_decode(s, c)) {
+        return;
+    }
+
+    while (1) {
+        int ret = recv(c->fd, c->rbuf + c->rlen, RBUF_SIZE - c->rlen, 0);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            conn_close(s, c);
+            return;
+        } else if (ret == 0) {
+            printf("disconnect %d\n", c->fd);
+            conn_close(s, c);
+            return;
+        }
+
+        c->rlen += ret;
+        if (conn_decode(s, c)) {
+            return;
+        }
+    }
+}
+
+static void on_accept(struct server *s) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        int clientfd = accept(s->listenfd, (struct sockaddr*)&client_addr, &client_len);
+        if (clientfd < 0) {
+            return;
+        }
+
+        if (clientfd >= MAX_CONN
+            || ip_table_allow(&s->ips, ntohl(client_addr.sin_addr.s_addr), s->now) < 0) {
+            close(clientfd);
+            continue;
+        }
+
+        struct conn *c = (struct conn*)malloc(sizeof(struct conn));
+        if (!c) {
+            close(clientfd);
+            continue;
+        }
+        c->fd = clientfd;
+        c->paused = 0;
+        c->next_paused = NULL;
+        c->rlen = 0;
+        tb_init(&c->frames, CONN_FRAME_RATE, s->now);
+        tb_init(&c->bytes, CONN_BYTE_RATE, s->now);
+
+        fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) | O_NONBLOCK);
+        s->conns[clientfd] = c;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = clientfd;
+        epoll_ctl(s->epfd, EPOLL_CTL_ADD, clientfd, &ev);
+    }
+}
+
+static int serve(int port) {
+    static struct server s;
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+
+    int on = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(sockfd, (struct sockaddr*)&addr, sizeof(struct sockaddr_in))) {
+        return -2;
+    }
+    if (listen(sockfd, 128) < 0) {
+        return -3;
+    }
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+
+    if (ip_table_init(&s.ips, 1 << 16) < 0) {
+        return -4;
+    }
+    s.listenfd = sockfd;
+    s.epfd = epoll_create(1);
+
+    struct epoll_event ev, events[1024];
+    ev.events = EPOLLIN;
+    ev.data.fd = sockfd;
+    epoll_ctl(s.epfd, EPOLL_CTL_ADD, sockfd, &ev);
+
+    while (1) {
+        s.now = now_ms();
+        int nready = epoll_wait(s.epfd, events, 1024, next_timeout(&s));
+        if (nready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        s.now = now_ms();
+        conn_resume_due(&s);
+
+        int i = 0;
+        for (i = 0; i < nready; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == sockfd) {
+                on_accept(&s);
+                continue;
+            }
+
+            struct conn *c = s.conns[fd];
+            if (!c) continue;
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                conn_close(&s, c);
+            } else if (!c->paused) {
+                conn_read(&s, c);
+            }
+        }
+    }
+    return 0;
+}
+
+/*-------------------------- 基准测试 --------------------------*/
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint32_t xorshift32(uint32_t *s) {
+    uint32_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *s = x;
+}
+
+static int bench(uint32_t nips) {
+    const int iters = 10000000;
+    struct ip_table t;
+    if (ip_table_init(&t, nips * 2) < 0) {
+        return -1;
+    }
+
+    uint32_t *ips = (uint32_t*)malloc(sizeof(uint32_t) * nips);
+    uint32_t seed = 2463534242u;
+    uint32_t i = 0;
+    for (i = 0; i < nips; ++i) {
+        ips[i] = xorshift32(&seed) | 1;
+    }
+
+    //预热：把nips个IP全部放进表里
+    uint64_t clock = 1000;
+    for (i = 0; i < nips; ++i) {
+        ip_table_allow(&t, ips[i], clock);
+    }
+
+    //IP层：随机IP，每1000次查询时钟前进1ms
+    unsigned long denied = 0;
+    uint64_t start = now_ns();
+    int k = 0;
+    for (k = 0; k < iters; ++k) {
+        if ((k & 1023) == 0) ++clock;
+        denied += ip_table_allow(&t, ips[xorshift32(&seed) % nips], clock) < 0;
+    }
+    uint64_t ip_ns = now_ns() - start;
+
+    //帧层：模拟1024个连接轮流来帧，帧的内容在缓冲区里只解头部。
+    //正常帧走的是放行路径，被限流的帧走的是拒绝路径，两者分开测：
+    //  under limit：每1024帧时钟前进10ms，每个连接100帧/秒，低于CONN_FRAME_RATE，全部放行；
+    //  over limit ：每1024帧时钟前进1ms，每个连接1000帧/秒，大部分被限流。
+    const int nconn = 1024;
+    struct conn *conns = (struct conn*)malloc(sizeof(struct conn) * nconn);
+    uint64_t frame_ns[2];
+    unsigned long limited[2];
+    const int step[2] = {10, 1};
+    int pass = 0;
+    for (pass = 0; pass < 2; ++pass) {
+        for (k = 0; k < nconn; ++k) {
+            tb_init(&conns[k].frames, CONN_FRAME_RATE, clock);
+            tb_init(&conns[k].bytes, CONN_BYTE_RATE, clock);
+        }
+
+        limited[pass] = 0;
+        start = now_ns();
+        for (k = 0; k < iters; ++k) {
+            if ((k & 1023) == 0) clock += step[pass];
+            limited[pass] += conn_limit_frame(&conns[k & (nconn - 1)], 64, clock) != 0;
+        }
+        frame_ns[pass] = now_ns() - start;
+    }
+
+    printf("tracked ips      : %u (table %u slots, %.1f MB)\n",
+        nips, t.mask + 1, (t.mask + 1) * sizeof(struct ip_entry) / 1048576.0);
+    printf("ip check         : %.1f ns/op, denied %lu, evictions %lu\n",
+        (double)ip_ns / iters, denied, t.evictions);
+    printf("frame under limit: %.1f ns/frame, limited %lu\n",
+        (double)frame_ns[0] / iters, limited[0]);
+    printf("frame over limit : %.1f ns/frame, limited %lu\n",
+        (double)frame_ns[1] / iters, limited[1]);
+
+    free(conns);
+    free(ips);
+    free(t.slots);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        return -1;
+    }
+
+    if (strcmp(argv[1], "bench") == 0) {
+        uint32_t nips = argc >= 3 ? (uint32_t)atoi(argv[2]) : 1000000;
+        return bench(nips ? nips : 1);
+    }
+
+    int port = atoi(argv[1]);
+    return serve(port);
+}
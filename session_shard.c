@@ -0,0 +1,423 @@
+//shared-nothing会话分片：每个reactor一个会话表，跨核访问走消息传递
+
+/*
+    游戏逻辑按连接保存会话状态。多reactor（多线程epoll）时，如果所有会话放在一张全局map里再加一把锁，
+    每次读写会话都要抢这把锁，核数越多锁越热，最后全部线程排队。
+
+    shared-nothing：
+        1.会话由接受这个连接的reactor（线程/核）拥有，只有它能读写，所以会话表不需要锁；
+        2.session id的高8位是所属分片号，任何线程拿到id就知道该找谁；
+        3.其他线程要访问不属于自己的会话时，不去碰对方的表，而是往对方的mailbox（mailbox.h）投递一个请求，
+          对方在自己的循环里执行，执行完把同一个请求对象投递回来作为应答。请求对象循环使用，不分配内存。
+        跨核访问变成了异步的一来一回，调用方要能接受“结果稍后回调”，这也是reactor里本来的编程方式。
+
+    会话表：开放寻址 + 线性探测，值直接内联在槽里（struct session 48字节），
+        查找时顺着数组往后找，不用跟指针跳到别处，一般一两条cache line就能命中。
+        删除用backward shift：把后面属于同一探测链的项往前挪，不留墓碑，长时间运行后探测长度不会退化。
+        负载因子保持在1/2以下。
+
+    测试：
+        每个线程一个分片，各自拥有SESSIONS_PER_SHARD个会话，
+        每个操作随机选一个会话做一次“读-改-写”（hp++），其中REMOTE_PCT%的会话属于其他分片。
+        sharded：本分片直接访问，其他分片走mailbox，最多WINDOW个请求在途；
+                 每个分片是一个epoll循环，mailbox的eventfd可读时才drain，没有本地操作可做时阻塞在epoll_wait；
+        global：所有会话在一张表里，一把pthread_mutex。
+        线程数1~32，输出总吞吐。
+        线程数超过CPU核数时两边都是在分时，锁不会真正在多核间争抢，看结果时要对照输出里的cpus。
+
+    编译运行：
+        gcc -O2 -o session_shard session_shard.c -lpthread
+        ./session_shard [跨分片百分比]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include "mailbox.h"
+
+#define MAX_SHARDS          32
+#define SESSIONS_PER_SHARD  16384
+#define OPS_PER_THREAD      200000
+#define WINDOW              64
+
+#define SID_SHARD(sid)      ((int)((sid) >> 56))
+#define SID_MAKE(shard, n)  (((uint64_t)(shard) << 56) | (uint64_t)(n))
+
+/*-------------------------- 会话表 --------------------------*/
+
+struct session {
+    uint64_t sid;   //0表示空槽
+    uint32_t uid;
+    int32_t hp;
+    int32_t x, y;
+    char name[24];
+};
+
+struct session_table {
+    struct session *slots;
+    uint32_t mask;
+    uint32_t count;
+};
+
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+static int table_init(struct session_table *t, uint32_t expect) {
+    uint32_t cap = 16;
+    while (cap < expect * 2) cap <<= 1;
+    t->slots = (struct session*)calloc(cap, sizeof(struct session));
+    t->mask = cap - 1;
+    t->count = 0;
+    return t->slots ? 0 : -1;
+}
+
+static struct session *table_find(struct session_table *t, uint64_t sid) {
+    uint32_t i = (uint32_t)mix64(sid) & t->mask;
+    while (1) {
+        struct session *s = &t->slots[i];
+        if (s->sid == sid) return s;
+        if (s->sid == 0) return NULL;
+        i = (i + 1) & t->mask;
+    }
+}
+
+//插入或返回已存在的槽；超过负载因子返回NULL（由调用方决定扩容时机）
+static struct session *table_insert(struct session_table *t, uint64_t sid) {
+    if ((t->count + 1) * 2 > t->mask + 1) {
+        return NULL;
+    }
+    uint32_t i = (uint32_t)mix64(sid) & t->mask;
+    while (1) {
+        struct session *s = &t->slots[i];
+        if (s->sid == sid) return s;
+        if (s->sid == 0) {
+            memset(s, 0, sizeof(*s));
+            s->sid = sid;
+            t->count++;
+            return s;
+        }
+        i = (i + 1) & t->mask;
+    }
+}
+
+static int table_erase(struct session_table *t, uint64_t sid) {
+    uint32_t i = (uint32_t)mix64(sid) & t->mask;
+    while (t->slots[i].sid != sid) {
+        if (t->slots[i].sid == 0) return -1;
+        i = (i + 1) & t->mask;
+    }
+
+    //backward shift：后面的项如果它的理想位置不在(i, j]之间，就挪到空出来的i
+    uint32_t j = i;
+    while (1) {
+        j = (j + 1) & t->mask;
+        if (t->slots[j].sid == 0) break;
+        uint32_t home = (uint32_t)mix64(t->slots[j].sid) & t->mask;
+        if (((j - home) & t->mask) >= ((j - i) & t->mask)) {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+    t->slots[i].sid = 0;
+    t->count--;
+    return 0;
+}
+
+/*-------------------------- 分片 --------------------------*/
+
+struct shard;
+
+//跨分片请求，去程在owner上执行，回程在origin上执行，同一个对象来回投递
+struct remote_req {
+    struct mb_task node;
+    struct shard *origin;
+    struct shard *owner;
+    uint64_t sid;
+    int32_t hp; //应答：修改后的值，-1表示会话不存在
+};
+
+struct shard {
+    int id;
+    pthread_t tid;
+    struct session_table table;
+    struct mailbox mb;
+    int epfd;   //每个分片一个reactor，mailbox的eventfd注册在里面
+
+    struct remote_req reqs[WINDOW];
+    struct remote_req *free_reqs[WINDOW];
+    int nfree;
+
+    unsigned long done;
+    unsigned long remote_done;
+    uint32_t seed;
+    char pad[64];
+};
+
+static struct shard g_shards[MAX_SHARDS];
+static int g_nshards;
+static int g_remote_pct = 10;
+static atomic_int g_finished;
+
+static void req_reply_exec(struct mb_task *task) {
+    struct remote_req *r = (struct remote_req*)task;
+    struct shard *sh = r->origin;
+    //这里就是业务的回调：拿到远端会话的结果继续处理
+    sh->remote_done++;
+    sh->done++;
+    sh->free_reqs[sh->nfree++] = r;
+}
+
+static void req_exec(struct mb_task *task) {
+    struct remote_req *r = (struct remote_req*)task;
+    struct session *s = table_find(&r->owner->table, r->sid);
+    r->hp = s ? ++s->hp : -1;
+
+    r->node.fn = req_reply_exec;
+    mailbox_post(&r->origin->mb, &r->node);
+}
+
+static inline uint32_t xorshift32(uint32_t *s) {
+    uint32_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *s = x;
+}
+
+static void shard_populate(struct shard *sh) {
+    uint32_t n = 0;
+    for (n = 1; n <= SESSIONS_PER_SHARD; ++n) {
+        struct session *s = table_insert(&sh->table, SID_MAKE(sh->id, n));
+        s->uid = n;
+        s->hp = 100;
+        snprintf(s->name, sizeof(s->name), "player%u", n);
+    }
+}
+
+//最后一个做完的分片唤醒所有分片，让阻塞在epoll_wait里的分片看到结束条件
+static void shard_finish(void) {
+    if (atomic_fetch_add(&g_finished, 1) + 1 == g_nshards) {
+        int i = 0;
+        for (i = 0; i < g_nshards; ++i) {
+            mb_wake(&g_shards[i].mb);
+        }
+    }
+}
+
+static void *shard_loop(void *arg) {
+    struct shard *sh = (struct shard*)arg;
+    unsigned long issued = 0;
+    int finished = 0;
+
+    while (1) {
+        //还有本地操作可做时不阻塞，否则（全部发出或者窗口满了）阻塞到有请求或应答投递过来
+        int timeout = issued < OPS_PER_THREAD && sh->nfree > 0 ? 0 : -1;
+        struct epoll_event ev;
+        int nready = epoll_wait(sh->epfd, &ev, 1, timeout);
+        if (nready > 0) {
+            //eventfd可读：处理投递给本分片的请求和应答
+            mailbox_drain(&sh->mb, 1024);
+        }
+
+        int i = 0;
+        for (i = 0; i < 64 && issued < OPS_PER_THREAD; ++i) {
+            uint32_t r = xorshift32(&sh->seed);
+            int owner = sh->id;
+            if (g_nshards > 1 && (int)(r % 100) < g_remote_pct) {
+                owner = (sh->id + 1 + (int)((r >> 8) % (g_nshards - 1))) % g_nshards;
+            }
+            uint64_t sid = SID_MAKE(owner, 1 + (r >> 12) % SESSIONS_PER_SHARD);
+
+            if (owner == sh->id) {
+                struct session *s = table_find(&sh->table, sid);
+                if (s) s->hp++;
+                sh->done++;
+            } else {
+                if (sh->nfree == 0) break; //窗口满了，先处理应答
+                struct remote_req *req = sh->free_reqs[--sh->nfree];
+                req->owner = &g_shards[owner];
+                req->sid = sid;
+                req->node.fn = req_exec;
+                mailbox_post(&req->owner->mb, &req->node);
+            }
+            issued++;
+        }
+
+        if (!finished && sh->done == OPS_PER_THREAD) {
+            finished = 1;
+            shard_finish();
+        }
+        //自己做完了也要继续服务其他分片的请求，直到所有分片都做完
+        if (finished && atomic_load(&g_finished) == g_nshards) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*-------------------------- 全局map + 锁 --------------------------*/
+
+static struct session_table g_table;
+static pthread_mutex_t g_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+struct gworker {
+    int id;
+    pthread_t tid;
+    uint32_t seed;
+};
+
+static void *global_loop(void *arg) {
+    struct gworker *w = (struct gworker*)arg;
+    unsigned long i = 0;
+    for (i = 0; i < OPS_PER_THREAD; ++i) {
+        uint32_t r = xorshift32(&w->seed);
+        int owner = w->id;
+        if (g_nshards > 1 && (int)(r % 100) < g_remote_pct) {
+            owner = (w->id + 1 + (int)((r >> 8) % (g_nshards - 1))) % g_nshards;
+        }
+        uint64_t sid = SID_MAKE(owner, 1 + (r >> 12) % SESSIONS_PER_SHARD);
+
+        pthread_mutex_lock(&g_mtx);
+        struct session *s = table_find(&g_table, sid);
+        if (s) s->hp++;
+        pthread_mutex_unlock(&g_mtx);
+    }
+    return NULL;
+}
+
+/*-------------------------- 测试 --------------------------*/
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static double run_sharded(int n) {
+    int i = 0, j = 0;
+    g_nshards = n;
+    atomic_store(&g_finished, 0);
+
+    for (i = 0; i < n; ++i) {
+        struct shard *sh = &g_shards[i];
+        memset(sh, 0, sizeof(*sh));
+        sh->id = i;
+        sh->seed = 2463534242u + i * 7919;
+        if (table_init(&sh->table, SESSIONS_PER_SHARD) < 0 || mailbox_init(&sh->mb) < 0) {
+            return -1;
+        }
+        sh->epfd = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &sh->mb;
+        if (sh->epfd < 0 || epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->mb.efd, &ev) < 0) {
+            return -1;
+        }
+        shard_populate(sh);
+        for (j = 0; j < WINDOW; ++j) {
+            sh->reqs[j].origin = sh;
+            sh->free_reqs[j] = &sh->reqs[j];
+        }
+        sh->nfree = WINDOW;
+    }
+
+    uint64_t start = now_ns();
+    for (i = 0; i < n; ++i) {
+        pthread_create(&g_shards[i].tid, NULL, shard_loop, &g_shards[i]);
+    }
+    for (i = 0; i < n; ++i) {
+        pthread_join(g_shards[i].tid, NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    for (i = 0; i < n; ++i) {
+        close(g_shards[i].epfd);
+        mailbox_destroy(&g_shards[i].mb);
+        free(g_shards[i].table.slots);
+    }
+    return (double)n * OPS_PER_THREAD * 1e3 / elapsed;
+}
+
+static double run_global(int n) {
+    int i = 0;
+    uint32_t k = 0;
+    g_nshards = n;
+
+    if (table_init(&g_table, (uint32_t)n * SESSIONS_PER_SHARD) < 0) {
+        return -1;
+    }
+    for (i = 0; i < n; ++i) {
+        for (k = 1; k <= SESSIONS_PER_SHARD; ++k) {
+            struct session *s = table_insert(&g_table, SID_MAKE(i, k));
+            s->uid = k;
+            s->hp = 100;
+        }
+    }
+
+    struct gworker ws[MAX_SHARDS];
+    uint64_t start = now_ns();
+    for (i = 0; i < n; ++i) {
+        ws[i].id = i;
+        ws[i].seed = 2463534242u + i * 7919;
+        pthread_create(&ws[i].tid, NULL, global_loop, &ws[i]);
+    }
+    for (i = 0; i < n; ++i) {
+        pthread_join(ws[i].tid, NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    free(g_table.slots);
+    return (double)n * OPS_PER_THREAD * 1e3 / elapsed;
+}
+
+//删除的正确性自检：backward shift之后剩下的key必须都还能找到
+static int table_selftest(void) {
+    struct session_table t;
+    if (table_init(&t, 4096) < 0) return -1;
+    uint32_t i = 0;
+    for (i = 1; i <= 4096; ++i) table_insert(&t, SID_MAKE(0, i));
+    for (i = 1; i <= 4096; i += 3) table_erase(&t, SID_MAKE(0, i));
+    int bad = 0;
+    for (i = 1; i <= 4096; ++i) {
+        int present = table_find(&t, SID_MAKE(0, i)) != NULL;
+        if (present != ((i - 1) % 3 != 0)) bad++;
+    }
+    free(t.slots);
+    return bad ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 2) {
+        g_remote_pct = atoi(argv[1]);
+    }
+    if (table_selftest() < 0) {
+        fprintf(stderr, "session table selftest failed\n");
+        return -1;
+    }
+
+    printf("remote %d%%, %d ops/thread, %ld cpus\n", g_remote_pct, OPS_PER_THREAD, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%7s %16s %16s\n", "threads", "sharded Mops/s", "global Mops/s");
+
+    int n = 0;
+    for (n = 1; n <= MAX_SHARDS; n *= 2) {
+        double s = run_sharded(n);
+        double g = run_global(n);
+        if (s < 0 || g < 0) {
+            return -2;
+        }
+        printf("%7d %16.2f %16.2f\n", n, s, g);
+    }
+    return 0;
+}